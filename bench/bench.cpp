@@ -0,0 +1,875 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "hash.h"
+#include "concurrent_hash.h"
+#include "frozen_hash.h"
+#include "hash_cache.h"
+#include "sentinel_hash.h"
+
+// ns/op of mtl::hash_map against std::unordered_map over key types, distributions, table sizes and load factors.
+// Every operation is timed in samples of kSample operations, the percentiles are taken over the samples.
+// The thread-safe maps are timed with 1, 2, 4, ... up to --threads threads, a sample is one run of all of them.
+// usage: bench [--max-size N] [--threads N] [--impl S] [--key S] [--dist S] [--op S] [--csv PATH]
+// the string options keep only the cases named in the comma-separated list S
+
+namespace {
+
+    constexpr size_t kSample = 256;
+
+    struct dense_policy : mtl::hash_policy {
+        static constexpr double max_load_factor = 0.875;
+    };
+
+    // a small map lives in the object itself until it outgrows 8 elements
+    struct inline_policy : mtl::hash_policy {
+        static constexpr size_t inline_capacity = 8;
+    };
+
+    enum class Dist { uniform, zipf, sequential, strided };
+
+    const char* Name(Dist dist) {
+        switch (dist) {
+            case Dist::uniform:
+                return "uniform";
+            case Dist::zipf:
+                return "zipf";
+            case Dist::strided:
+                return "strided";
+            default:
+                return "sequential";
+        }
+    }
+
+    // splitmix64 finalizer, a bijection: distinct indices give distinct keys
+    uint64_t Mix(uint64_t x) {
+        x = (x ^ (x >> 30u)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27u)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31u);
+    }
+
+    struct ShortString {
+        using type = std::string;
+        static constexpr const char* name = "string8";
+    };
+
+    struct LongString {
+        using type = std::string;
+        static constexpr const char* name = "string48";
+    };
+
+    template<typename Key>
+    struct KeyOf {
+        using type = Key;
+        static constexpr const char* name = std::is_same_v<Key, int> ? "int" : "uint64";
+    };
+
+    // the i-th key of a set, sequential keys are 0, 1, 2, ... or their decimal representations,
+    // strided integer keys are multiples of a power of two like aligned addresses or ids with packed low fields
+    int MakeKey(KeyOf<int>, uint64_t i, Dist dist) {
+        if (dist == Dist::strided) {
+            return static_cast<int>(static_cast<uint32_t>(i) << 4u);
+        }
+        return static_cast<int>(dist == Dist::sequential ? i : static_cast<uint32_t>(i) * 2654435761u);
+    }
+
+    uint64_t MakeKey(KeyOf<uint64_t>, uint64_t i, Dist dist) {
+        if (dist == Dist::strided) {
+            return i << 20u;
+        }
+        return dist == Dist::sequential ? i : Mix(i);
+    }
+
+    std::string MakeKey(ShortString, uint64_t i, Dist dist) {
+        // 20 digits for the largest i, the keys of the runs take 8
+        char buffer[24];
+        if (dist == Dist::sequential) {
+            std::snprintf(buffer, sizeof(buffer), "%08llu", static_cast<unsigned long long>(i));
+        } else {
+            std::snprintf(buffer, sizeof(buffer), "%08x", static_cast<uint32_t>(i) * 2654435761u);
+        }
+        return buffer;
+    }
+
+    std::string MakeKey(LongString, uint64_t i, Dist dist) {
+        char buffer[64];
+        if (dist == Dist::sequential) {
+            std::snprintf(buffer, sizeof(buffer), "/srv/objects/%020llu/payload.bin", static_cast<unsigned long long>(i));
+        } else {
+            std::snprintf(buffer, sizeof(buffer), "/srv/objects/%016llx/payload.bin",
+                          static_cast<unsigned long long>(Mix(i)));
+        }
+        return buffer;
+    }
+
+    template<typename Key, typename Policy, typename Hash = mtl::hash<Key>>
+    struct MtlMap {
+        mtl::hash_map<Key, uint64_t, std::allocator<std::pair<Key, uint64_t>>, Hash, Policy> map;
+
+        void Reserve(size_t size) { map.reserve(size); }
+
+        void Insert(const Key& key, uint64_t value) { map.Insert(key, value); }
+
+        bool Contains(const Key& key) { return map.Contains(key); }
+
+        void Delete(const Key& key) { map.Delete(key); }
+
+        uint64_t Iterate() {
+            uint64_t sum = 0;
+            for (auto& pair: map) {
+                sum += pair.second;
+            }
+            return sum;
+        }
+
+        void Grow() { map.reserve(map.size() * 2); }
+
+        double Load() { return double(map.size()) / double(map.capacity()); }
+
+        void Build(std::span<const std::pair<Key, uint64_t>> pairs, size_t threads) {
+            map.BuildParallel(pairs, threads);
+        }
+    };
+
+    // the bench keys stay far from the max and max - 1 sentinels
+    template<typename Key>
+    struct SentinelMap {
+        mtl::sentinel_hash_map<Key, uint64_t> map;
+
+        void Reserve(size_t size) { map.reserve(size); }
+
+        void Insert(const Key& key, uint64_t value) { map.Insert(key, value); }
+
+        bool Contains(const Key& key) { return map.Contains(key); }
+
+        void Delete(const Key& key) { map.Delete(key); }
+
+        uint64_t Iterate() {
+            uint64_t sum = 0;
+            for (auto& pair: map) {
+                sum += pair.second;
+            }
+            return sum;
+        }
+
+        void Grow() { map.reserve(map.size() * 2); }
+
+        double Load() { return double(map.size()) / double(map.capacity()); }
+    };
+
+    template<typename Key>
+    struct FrozenMap {
+        std::optional<mtl::frozen_map<Key, uint64_t>> map;
+
+        void Build(std::span<const std::pair<Key, uint64_t>> pairs, size_t) { map.emplace(pairs); }
+
+        bool Contains(const Key& key) { return map->Contains(key); }
+
+        uint64_t Iterate() {
+            uint64_t sum = 0;
+            for (auto& pair: *map) {
+                sum += pair.second;
+            }
+            return sum;
+        }
+
+        // exactly size() slots
+        double Load() { return 1; }
+    };
+
+    template<typename Key>
+    struct StdMap {
+        std::unordered_map<Key, uint64_t> map;
+
+        void Reserve(size_t size) { map.reserve(size); }
+
+        void Insert(const Key& key, uint64_t value) { map.insert_or_assign(key, value); }
+
+        bool Contains(const Key& key) { return map.find(key) != map.end(); }
+
+        void Delete(const Key& key) { map.erase(key); }
+
+        uint64_t Iterate() {
+            uint64_t sum = 0;
+            for (auto& pair: map) {
+                sum += pair.second;
+            }
+            return sum;
+        }
+
+        void Grow() { map.rehash(map.bucket_count() * 2); }
+
+        double Load() { return map.load_factor(); }
+    };
+
+    template<typename Key>
+    struct MtlSet {
+        static constexpr bool kThreaded = true;
+
+        mtl::hash_set<Key> set;
+
+        void Insert(const Key& key) { set.Insert(key); }
+
+        // the size of the union, intersect or difference with other
+        size_t Apply(std::string_view op, MtlSet& other, size_t threads) {
+            mtl::hash_set<Key> result;
+            if (op == "union") {
+                set.Union(other.set, result, threads);
+            } else if (op == "intersect") {
+                set.Intersect(other.set, result, threads);
+            } else {
+                set.Difference(other.set, result, threads);
+            }
+            return result.size();
+        }
+    };
+
+    // the loops the set operations are written as without them
+    template<typename Key>
+    struct StdSet {
+        static constexpr bool kThreaded = false;
+
+        std::unordered_set<Key> set;
+
+        void Insert(const Key& key) { set.insert(key); }
+
+        size_t Apply(std::string_view op, StdSet& other, size_t) {
+            std::unordered_set<Key> result;
+            if (op == "union") {
+                result = set;
+                result.insert(other.set.begin(), other.set.end());
+            } else {
+                for (auto& key: set) {
+                    if (other.set.contains(key) == (op == "intersect")) {
+                        result.insert(key);
+                    }
+                }
+            }
+            return result.size();
+        }
+    };
+
+    template<typename Key>
+    struct MtlCounter {
+        static constexpr bool kThreaded = true;
+
+        mtl::hash_multiset<Key> multiset;
+
+        void Count(std::span<const Key> values, size_t threads) { multiset.CountParallel(values, threads); }
+
+        size_t Size() { return multiset.size(); }
+    };
+
+    template<typename Key>
+    struct StdCounter {
+        static constexpr bool kThreaded = false;
+
+        std::unordered_map<Key, uint64_t> counts;
+
+        void Count(std::span<const Key> values, size_t) {
+            for (auto& value: values) {
+                ++counts[value];
+            }
+        }
+
+        size_t Size() { return counts.size(); }
+    };
+
+    template<typename Key>
+    struct MtlCache {
+        mtl::hash_cache<Key, uint64_t> cache;
+
+        explicit MtlCache(size_t size) : cache(size) {}
+
+        // whether the key was cached, it is afterwards
+        bool Access(const Key& key, uint64_t value) {
+            if (cache.Find(key)) {
+                return true;
+            }
+            cache.Insert(key, value);
+            return false;
+        }
+    };
+
+    // the usual LRU: a list in use order and a map of iterators into it
+    template<typename Key>
+    struct LruCache {
+        std::list<std::pair<Key, uint64_t>> order;
+        std::unordered_map<Key, typename decltype(order)::iterator> map;
+        size_t size;
+
+        explicit LruCache(size_t size) : map(size), size(size) {}
+
+        bool Access(const Key& key, uint64_t value) {
+            if (auto it = map.find(key); it != map.end()) {
+                order.splice(order.begin(), order, it->second);
+                return true;
+            }
+            if (order.size() == size) {
+                map.erase(order.back().first);
+                order.pop_back();
+            }
+            order.emplace_front(key, value);
+            map[key] = order.begin();
+            return false;
+        }
+    };
+
+    template<typename Key>
+    struct ConcurrentMap {
+        mtl::concurrent_hash_map<Key, uint64_t> map;
+
+        void Insert(const Key& key, uint64_t value) { map.Insert(key, value); }
+
+        bool Contains(const Key& key) { return map.Contains(key); }
+    };
+
+    template<typename Key>
+    struct ReadMostlyMap {
+        mtl::read_mostly_hash_map<Key, uint64_t> map;
+
+        void Insert(const Key& key, uint64_t value) { map.Insert(key, value); }
+
+        bool Contains(const Key& key) { return map.Contains(key); }
+    };
+
+    // the usual way to share a map: one mutex around all of it
+    template<typename Key>
+    struct LockedMap {
+        mtl::hash_map<Key, uint64_t> map;
+        std::mutex mutex;
+
+        void Insert(const Key& key, uint64_t value) {
+            std::lock_guard<std::mutex> lock(mutex);
+            map.Insert(key, value);
+        }
+
+        bool Contains(const Key& key) {
+            std::lock_guard<std::mutex> lock(mutex);
+            return map.Contains(key);
+        }
+    };
+
+    struct Options {
+        size_t max_size = 5000000;
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        std::string impl, key, dist, op;
+        FILE* csv = nullptr;
+    };
+
+    struct Result {
+        double mean, p50, p90, p99;
+    };
+
+    // the samples hold ns/op
+    Result Summarize(std::vector<double>& samples) {
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (auto sample: samples) {
+            sum += sample;
+        }
+        auto at = [&samples](double q) { return samples[std::min(samples.size() - 1, size_t(q * samples.size()))]; };
+        return {sum / samples.size(), at(0.5), at(0.9), at(0.99)};
+    }
+
+    // times op(i) for i in [0, count) in samples of kSample calls
+    template<typename Op>
+    void Measure(std::vector<double>& samples, size_t count, Op op) {
+        for (size_t first = 0; first < count; first += kSample) {
+            auto last = std::min(count, first + kSample);
+            auto start = std::chrono::steady_clock::now();
+            for (auto i = first; i < last; ++i) {
+                op(i);
+            }
+            auto end = std::chrono::steady_clock::now();
+            samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(last - first));
+        }
+    }
+
+    volatile uint64_t sink;
+
+    // whether name is one of the comma-separated names of the filter, an empty filter selects everything
+    bool Selected(const std::string& filter, std::string_view name) {
+        if (filter.empty()) {
+            return true;
+        }
+        for (size_t first = 0; first <= filter.size();) {
+            auto last = std::min(filter.find(',', first), filter.size());
+            if (std::string_view(filter).substr(first, last - first) == name) {
+                return true;
+            }
+            first = last + 1;
+        }
+        return false;
+    }
+
+    void Report(const Options& options, const char* impl, const char* key, Dist dist, size_t size, double load,
+                const char* op, size_t threads, std::vector<double>& samples) {
+        auto result = Summarize(samples);
+        std::printf("%-12s %-9s %-10s %9zu %5.2f %-10s %7zu %9.1f %9.1f %9.1f %9.1f\n", impl, key, Name(dist), size,
+                    load, op, threads, result.mean, result.p50, result.p90, result.p99);
+        if (options.csv) {
+            std::fprintf(options.csv, "%s,%s,%s,%zu,%.3f,%s,%zu,%.2f,%.2f,%.2f,%.2f\n", impl, key, Name(dist), size,
+                         load, op, threads, result.mean, result.p50, result.p90, result.p99);
+            std::fflush(options.csv);
+        }
+    }
+
+    // 1, 2, 4, ... and options.threads itself
+    std::vector<size_t> ThreadCounts(const Options& options) {
+        std::vector<size_t> counts;
+        for (size_t threads = 1; threads < options.threads; threads *= 2) {
+            counts.push_back(threads);
+        }
+        counts.push_back(options.threads);
+        return counts;
+    }
+
+    // runs work(t) for t in [0, threads) on threads threads at once, returns the wall time in ns
+    template<typename Work>
+    double TimeThreads(size_t threads, Work work) {
+        std::vector<std::thread> pool;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < threads; ++t) {
+            pool.emplace_back(work, t);
+        }
+        for (auto& thread: pool) {
+            thread.join();
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count();
+    }
+
+    // the positions of the accessed keys among size keys
+    std::vector<uint32_t> AccessOrder(Dist dist, size_t size, size_t count, std::mt19937_64& random) {
+        std::vector<uint32_t> order(count);
+        if (dist == Dist::sequential) {
+            for (size_t i = 0; i < count; ++i) {
+                order[i] = static_cast<uint32_t>(i % size);
+            }
+        } else if (dist == Dist::uniform || dist == Dist::strided) {
+            std::uniform_int_distribution<uint32_t> uniform(0, static_cast<uint32_t>(size - 1));
+            for (auto& position: order) {
+                position = uniform(random);
+            }
+        } else {
+            // Zipf with s = 0.99 by inverting the cumulative distribution
+            std::vector<double> cdf(size);
+            double sum = 0;
+            for (size_t rank = 0; rank < size; ++rank) {
+                sum += 1.0 / std::pow(double(rank + 1), 0.99);
+                cdf[rank] = sum;
+            }
+            std::uniform_real_distribution<double> uniform(0, sum);
+            for (auto& position: order) {
+                auto rank = std::lower_bound(cdf.begin(), cdf.end(), uniform(random)) - cdf.begin();
+                position = static_cast<uint32_t>(std::min<size_t>(rank, size - 1));
+            }
+        }
+        return order;
+    }
+
+    // the keys of one case, shared by all the implementations
+    template<typename Kind>
+    struct Workload {
+        using Key = typename Kind::type;
+
+        Dist dist;
+        size_t size;
+        std::vector<Key> keys, absent;// size keys that are inserted and size that never are
+        size_t rounds;// small tables are rebuilt and queried several times for enough samples
+        size_t queries;
+        std::vector<uint32_t> order;// the positions of the queried keys
+
+        Workload(Dist dist, size_t size) : dist(dist), size(size), keys(size), absent(size),
+                                           rounds(std::max<size_t>(1, (size_t(1) << 16u) / size)),
+                                           queries(std::clamp<size_t>(size, size_t(1) << 16u, size_t(1) << 22u)) {
+            std::mt19937_64 random(size);
+            for (size_t i = 0; i < size; ++i) {
+                keys[i] = MakeKey(Kind(), i, dist);
+                absent[i] = MakeKey(Kind(), size + i, dist);
+            }
+            order = AccessOrder(dist, size, queries, random);
+        }
+    };
+
+    template<typename Map, typename Kind>
+    void Run(const Options& options, const char* impl, const Workload<Kind>& workload) {
+        using Key = typename Kind::type;
+        auto& [dist, size, keys, absent, rounds, queries, order] = workload;
+        auto report = [&](const char* op, double load, std::vector<double>& samples) {
+            Report(options, impl, Kind::name, dist, size, load, op, 1, samples);
+        };
+        // an immutable table is only built from all the pairs at once and queried
+        constexpr bool kMutable = requires(Map& map, const Key& key) { map.Delete(key); };
+        auto pairs = [&keys, size] {
+            std::vector<std::pair<Key, uint64_t>> pairs;
+            for (size_t i = 0; i < size; ++i) {
+                pairs.emplace_back(keys[i], i);
+            }
+            return pairs;
+        };
+        // grown by the inserts, so the load factor is wherever the size puts it between two grows
+        auto build = [&keys, &pairs, size](Map& map) {
+            if constexpr (kMutable) {
+                for (size_t i = 0; i < size; ++i) {
+                    map.Insert(keys[i], i);
+                }
+            } else {
+                map.Build(pairs(), 1);
+            }
+        };
+
+        std::vector<double> samples;
+        double load = 0;
+        if constexpr (kMutable) {
+            if (Selected(options.op, "insert")) {
+                for (size_t round = 0; round < rounds; ++round) {
+                    Map map;
+                    map.Reserve(size);
+                    Measure(samples, size, [&map, &keys](size_t i) { map.Insert(keys[i], i); });
+                    load = map.Load();
+                }
+                report("insert", load, samples);
+            }
+        }
+        if constexpr (requires(Map& map, std::span<const std::pair<Key, uint64_t>> pairs) { map.Build(pairs, 1); }) {
+            if (Selected(options.op, "build")) {
+                // a table built from all the pairs at once, with 1, 2, 4, ... threads, ns per element
+                auto all = pairs();
+                for (auto threads: ThreadCounts(options)) {
+                    if (!kMutable && threads > 1) {
+                        break;
+                    }
+                    samples.clear();
+                    for (size_t round = 0; round < rounds; ++round) {
+                        Map map;
+                        auto start = std::chrono::steady_clock::now();
+                        map.Build(all, threads);
+                        auto end = std::chrono::steady_clock::now();
+                        samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(size));
+                        load = map.Load();
+                    }
+                    Report(options, impl, Kind::name, dist, size, load, "build", threads, samples);
+                }
+            }
+        }
+
+        Map map;
+        build(map);
+        load = map.Load();
+        if (Selected(options.op, "hit")) {
+            samples.clear();
+            uint64_t found = 0;
+            Measure(samples, queries, [&](size_t i) { found += map.Contains(keys[order[i]]); });
+            sink = found;
+            report("hit", load, samples);
+        }
+        if (Selected(options.op, "miss")) {
+            samples.clear();
+            uint64_t found = 0;
+            Measure(samples, queries, [&](size_t i) { found += map.Contains(absent[order[i]]); });
+            sink = found;
+            report("miss", load, samples);
+        }
+        if (Selected(options.op, "iterate")) {
+            samples.clear();
+            // one sample per pass, ns per element
+            for (size_t round = 0; round < std::max<size_t>(rounds, 16); ++round) {
+                auto start = std::chrono::steady_clock::now();
+                sink = map.Iterate();
+                auto end = std::chrono::steady_clock::now();
+                samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(size));
+            }
+            report("iterate", load, samples);
+        }
+        if constexpr (kMutable) {
+            if (Selected(options.op, "churn")) {
+                // every operation deletes a present key and inserts an absent one in its place
+                samples.clear();
+                auto present = keys, missing = absent;
+                Measure(samples, queries, [&](size_t i) {
+                    auto j = order[i];
+                    map.Delete(present[j]);
+                    map.Insert(missing[j], j);
+                    std::swap(present[j], missing[j]);
+                });
+                report("churn", map.Load(), samples);
+            }
+            if (Selected(options.op, "rehash")) {
+                // one sample per doubling of a full table, ns per element
+                samples.clear();
+                for (size_t round = 0; round < rounds; ++round) {
+                    Map full;
+                    build(full);
+                    auto start = std::chrono::steady_clock::now();
+                    full.Grow();
+                    auto end = std::chrono::steady_clock::now();
+                    samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(size));
+                }
+                report("rehash", load, samples);
+            }
+        }
+    }
+
+    // inserts of disjoint slices of the keys and lookups of the queried keys from every number of threads,
+    // ns/op of the whole run: the inverse of the total throughput
+    template<typename Map, typename Kind>
+    void RunConcurrent(const Options& options, const char* impl, const Workload<Kind>& workload) {
+        auto& [dist, size, keys, absent, rounds, queries, order] = workload;
+        for (auto threads: ThreadCounts(options)) {
+            std::vector<double> samples;
+            if (Selected(options.op, "insert")) {
+                for (size_t round = 0; round < rounds; ++round) {
+                    Map map;
+                    auto ns = TimeThreads(threads, [&map, &keys, size, threads](size_t t) {
+                        for (auto i = size * t / threads; i < size * (t + 1) / threads; ++i) {
+                            map.Insert(keys[i], i);
+                        }
+                    });
+                    samples.push_back(ns / double(size));
+                }
+                Report(options, impl, Kind::name, dist, size, 0, "insert", threads, samples);
+            }
+            if (Selected(options.op, "hit")) {
+                samples.clear();
+                Map map;
+                for (size_t i = 0; i < size; ++i) {
+                    map.Insert(keys[i], i);
+                }
+                for (size_t round = 0; round < std::max<size_t>(rounds, 16); ++round) {
+                    auto ns = TimeThreads(threads, [&map, &keys, &order, queries, threads](size_t t) {
+                        uint64_t found = 0;
+                        for (auto i = queries * t / threads; i < queries * (t + 1) / threads; ++i) {
+                            found += map.Contains(keys[order[i]]);
+                        }
+                        sink = found;
+                    });
+                    samples.push_back(ns / double(queries));
+                }
+                Report(options, impl, Kind::name, dist, size, 0, "hit", threads, samples);
+            }
+        }
+    }
+
+    // a million maps of 6 int keys each are created on the heap, filled, queried once and destroyed, ns per map
+    template<typename Map>
+    void RunTiny(const Options& options, const char* impl) {
+        constexpr size_t kTiny = 6;
+        std::vector<double> samples;
+        uint64_t found = 0;
+        double load = 0;
+        Measure(samples, 1000000, [&found, &load](size_t i) {
+            auto map = std::make_unique<Map>();
+            for (size_t j = 0; j < kTiny; ++j) {
+                map->Insert(static_cast<int>(i + j), j);
+            }
+            found += map->Contains(static_cast<int>(i + kTiny / 2));
+            load = map->Load();
+        });
+        sink = found;
+        Report(options, impl, "int", Dist::sequential, kTiny, load, "tiny", 1, samples);
+    }
+
+    // the keys against their second half and as many absent keys, so half of either set is common,
+    // one sample per operation on the whole sets with 1, 2, 4, ... threads, ns per element of both sets
+    template<typename Set, typename Kind>
+    void RunSetOps(const Options& options, const char* impl, const Workload<Kind>& workload) {
+        auto& [dist, size, keys, absent, rounds, queries, order] = workload;
+        Set left, right;
+        for (size_t i = 0; i < size; ++i) {
+            left.Insert(keys[i]);
+            right.Insert(i < size / 2 ? absent[i] : keys[i]);
+        }
+        for (auto op: {"union", "intersect", "difference"}) {
+            if (!Selected(options.op, op)) {
+                continue;
+            }
+            for (auto threads: ThreadCounts(options)) {
+                if (!Set::kThreaded && threads > 1) {
+                    break;
+                }
+                std::vector<double> samples;
+                for (size_t round = 0; round < std::max<size_t>(rounds, 4); ++round) {
+                    auto start = std::chrono::steady_clock::now();
+                    sink = left.Apply(op, right, threads);
+                    auto end = std::chrono::steady_clock::now();
+                    samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(2 * size));
+                }
+                Report(options, impl, Kind::name, dist, size, 0, op, threads, samples);
+            }
+        }
+    }
+
+    // the occurrences of every key of the query stream counted with 1, 2, 4, ... threads, ns per value
+    template<typename Counter, typename Kind>
+    void RunCount(const Options& options, const char* impl, const Workload<Kind>& workload) {
+        using Key = typename Kind::type;
+        auto& [dist, size, keys, absent, rounds, queries, order] = workload;
+        std::vector<Key> values(queries);
+        for (size_t i = 0; i < queries; ++i) {
+            values[i] = keys[order[i]];
+        }
+        for (auto threads: ThreadCounts(options)) {
+            if (!Counter::kThreaded && threads > 1) {
+                break;
+            }
+            std::vector<double> samples;
+            for (size_t round = 0; round < 4; ++round) {
+                Counter counter;
+                auto start = std::chrono::steady_clock::now();
+                counter.Count(values, threads);
+                auto end = std::chrono::steady_clock::now();
+                samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / double(queries));
+                sink = counter.Size();
+            }
+            Report(options, impl, Kind::name, dist, size, 0, "count", threads, samples);
+        }
+    }
+
+    // the query stream through a cache of a tenth of the keys, a miss inserts the key, ns per access;
+    // the load column holds the hit ratio
+    template<typename Cache, typename Kind>
+    void RunCache(const Options& options, const char* impl, const Workload<Kind>& workload) {
+        auto& [dist, size, keys, absent, rounds, queries, order] = workload;
+        std::vector<double> samples;
+        Cache cache(std::max<size_t>(size / 10, 16));
+        uint64_t hits = 0;
+        Measure(samples, queries, [&](size_t i) { hits += cache.Access(keys[order[i]], i); });
+        Report(options, impl, Kind::name, dist, size, double(hits) / double(queries), "cache", 1, samples);
+    }
+
+    template<typename Kind>
+    void RunKey(const Options& options) {
+        if (!Selected(options.key, Kind::name)) {
+            return;
+        }
+        using Key = typename Kind::type;
+        // from L1-resident tables to ones far beyond the last level cache, the steps are not powers of two so the load factor varies
+        for (size_t size = 1000; size <= options.max_size; size *= 12) {
+            for (auto dist: {Dist::uniform, Dist::zipf, Dist::sequential, Dist::strided}) {
+                if (!Selected(options.dist, Name(dist)) || (dist == Dist::strided && !std::is_integral_v<Key>)) {
+                    continue;
+                }
+                Workload<Kind> workload(dist, size);
+                if (Selected(options.impl, "mtl")) {
+                    Run<MtlMap<Key, mtl::hash_policy>>(options, "mtl", workload);
+                }
+                if (Selected(options.impl, "mtl_dense")) {
+                    Run<MtlMap<Key, dense_policy>>(options, "mtl_dense", workload);
+                }
+                if (Selected(options.impl, "mtl_std_hash")) {
+                    Run<MtlMap<Key, mtl::hash_policy, std::hash<Key>>>(options, "mtl_std_hash", workload);
+                }
+                if constexpr (std::is_integral_v<Key>) {
+                    if (Selected(options.impl, "sentinel")) {
+                        Run<SentinelMap<Key>>(options, "sentinel", workload);
+                    }
+                }
+                if (Selected(options.impl, "frozen")) {
+                    Run<FrozenMap<Key>>(options, "frozen", workload);
+                }
+                if (Selected(options.impl, "std")) {
+                    Run<StdMap<Key>>(options, "std", workload);
+                }
+                if (Selected(options.impl, "mtl")) {
+                    RunSetOps<MtlSet<Key>>(options, "mtl", workload);
+                }
+                if (Selected(options.impl, "std")) {
+                    RunSetOps<StdSet<Key>>(options, "std", workload);
+                }
+                if (Selected(options.op, "count")) {
+                    if (Selected(options.impl, "mtl")) {
+                        RunCount<MtlCounter<Key>>(options, "mtl", workload);
+                    }
+                    if (Selected(options.impl, "std")) {
+                        RunCount<StdCounter<Key>>(options, "std", workload);
+                    }
+                }
+                if (Selected(options.op, "cache")) {
+                    if (Selected(options.impl, "mtl")) {
+                        RunCache<MtlCache<Key>>(options, "mtl", workload);
+                    }
+                    if (Selected(options.impl, "std")) {
+                        RunCache<LruCache<Key>>(options, "std", workload);
+                    }
+                }
+                if (Selected(options.impl, "concurrent")) {
+                    RunConcurrent<ConcurrentMap<Key>>(options, "concurrent", workload);
+                }
+                if (Selected(options.impl, "read_mostly")) {
+                    RunConcurrent<ReadMostlyMap<Key>>(options, "read_mostly", workload);
+                }
+                if (Selected(options.impl, "locked")) {
+                    RunConcurrent<LockedMap<Key>>(options, "locked", workload);
+                }
+            }
+        }
+    }
+
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--max-size") {
+            options.max_size = std::stoull(value);
+        } else if (flag == "--threads") {
+            options.threads = std::max<size_t>(1, std::stoull(value));
+        } else if (flag == "--impl") {
+            options.impl = value;
+        } else if (flag == "--key") {
+            options.key = value;
+        } else if (flag == "--dist") {
+            options.dist = value;
+        } else if (flag == "--op") {
+            options.op = value;
+        } else if (flag == "--csv") {
+            options.csv = std::fopen(value.c_str(), "w");
+            if (!options.csv) {
+                std::fprintf(stderr, "cannot open %s\n", value.c_str());
+                return 1;
+            }
+            std::fprintf(options.csv, "impl,key,dist,size,load,op,threads,mean_ns,p50_ns,p90_ns,p99_ns\n");
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", flag.c_str());
+            return 1;
+        }
+    }
+    std::printf("%-12s %-9s %-10s %9s %5s %-10s %7s %9s %9s %9s %9s\n", "impl", "key", "dist", "size", "load", "op",
+                "threads", "mean_ns", "p50_ns", "p90_ns", "p99_ns");
+    if (Selected(options.op, "tiny") && Selected(options.key, "int") && Selected(options.dist, "sequential")) {
+        if (Selected(options.impl, "mtl")) {
+            RunTiny<MtlMap<int, mtl::hash_policy>>(options, "mtl");
+        }
+        if (Selected(options.impl, "mtl_inline")) {
+            RunTiny<MtlMap<int, inline_policy>>(options, "mtl_inline");
+        }
+        if (Selected(options.impl, "std")) {
+            RunTiny<StdMap<int>>(options, "std");
+        }
+    }
+    RunKey<KeyOf<int>>(options);
+    RunKey<KeyOf<uint64_t>>(options);
+    RunKey<ShortString>(options);
+    RunKey<LongString>(options);
+    if (options.csv) {
+        std::fclose(options.csv);
+    }
+    return 0;
+}
@@ -0,0 +1,595 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+
+#include "hash.h"
+
+namespace mtl {
+
+    namespace detail {
+
+        // epoch-based reclamation shared by all read_mostly_hash_maps. A reader announces the epoch it started in
+        // inside its own record, a writer tags the memory it unlinks with the current epoch and frees it once every
+        // active reader has announced a later one
+        class epoch {
+            static constexpr uint64_t kIdle = UINT64_MAX;
+
+            // a cache line per thread, records are reused by the next threads and never freed
+            struct alignas(64) Record {
+                std::atomic<uint64_t> epoch{kIdle};
+                std::atomic<bool> used{true};
+                size_t depth = 0;
+                Record* next = nullptr;
+            };
+
+        public:
+            class guard {
+            public:
+                guard() : record(Local()) {
+                    if (record->depth++ == 0) {
+                        record->epoch.store(current.load(std::memory_order_acquire), std::memory_order_relaxed);
+                        // pairs with the fence in Min: either the writer sees this epoch or the reader sees the unlink
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                    }
+                }
+
+                ~guard() {
+                    if (--record->depth == 0) {
+                        record->epoch.store(kIdle, std::memory_order_release);
+                    }
+                }
+
+                guard(const guard&) = delete;
+
+                guard& operator=(const guard&) = delete;
+
+            private:
+                Record* record;
+            };
+
+            // the epoch to tag the memory unlinked before the call with
+            static inline uint64_t Retire() { return current.fetch_add(1, std::memory_order_seq_cst); }
+
+            // memory tagged with an epoch below this one is not reachable by any reader
+            static inline uint64_t Min() {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto min = current.load(std::memory_order_relaxed);
+                for (auto record = head.load(std::memory_order_acquire); record; record = record->next) {
+                    min = std::min(min, record->epoch.load(std::memory_order_acquire));
+                }
+                return min;
+            }
+
+        private:
+            struct Holder {
+                Record* record = Acquire();
+
+                ~Holder() { record->used.store(false, std::memory_order_release); }
+            };
+
+            static inline Record* Acquire() {
+                for (auto record = head.load(std::memory_order_acquire); record; record = record->next) {
+                    bool used = false;
+                    if (!record->used.load(std::memory_order_relaxed) &&
+                        record->used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+                        return record;
+                    }
+                }
+                auto record = new Record;
+                record->next = head.load(std::memory_order_relaxed);
+                while (!head.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                                   std::memory_order_relaxed)) {}
+                return record;
+            }
+
+            static inline Record* Local() {
+                thread_local Holder holder;
+                return holder.record;
+            }
+
+            static inline std::atomic<uint64_t> current{0};
+            static inline std::atomic<Record*> head{nullptr};
+        };
+
+    }
+
+    // hash_map split into Shards independent tables by the high bits of the key's hash, every shard has its own
+    // reader-writer lock and grows on its own. All methods are thread-safe, the callbacks of Upsert and
+    // ComputeIfPresent run under the lock of the key's shard and must not touch the map
+    template<typename T, typename U, typename Alloc = std::allocator<std::pair<T, U>>, typename Hash = hash<T>,
+            typename Policy = hash_policy, size_t Shards = 64>
+    class concurrent_hash_map {
+        static_assert(std::has_single_bit(Shards), "the number of shards must be a power of two");
+
+    private:
+        struct Compare {
+            using is_transparent = void;
+
+            template<typename K>
+            inline bool operator()(const std::pair<T, U>& pair, const K& key) const {
+                return pair.first == key;
+            }
+        };
+
+        struct KeyByValue {
+            inline const T& operator()(const std::pair<T, U>& pair) const {
+                return pair.first;
+            }
+        };
+
+        // the incremental migration runs inside lookups and the stats are written by them,
+        // so they need the exclusive lock in these modes
+        using ReadLock = std::conditional_t<Policy::incremental_rehash == 0 && !Policy::collect_stats,
+                std::shared_lock<std::shared_mutex>, std::unique_lock<std::shared_mutex>>;
+        using WriteLock = std::unique_lock<std::shared_mutex>;
+
+        // a cache line per shard so that the locks of neighbouring shards do not share it
+        struct alignas(64) Shard {
+            Shard() : hashTable(1) {}
+
+            std::shared_mutex mutex;
+            HashTable<T, std::pair<T, U>, Compare, Alloc, Hash, Policy> hashTable;
+        };
+
+        inline size_t ShardOf(size_t hash) const {
+            if constexpr (Shards == 1) {
+                return 0;
+            }
+            // the table indexes use the low bits or the golden ratio product, the shards take another mixing
+            return (hash * 0xD6E8FEB86659FD93ull) >> (64u - std::countr_zero(Shards));
+        }
+
+        Hash hash;
+        std::unique_ptr<Shard[]> shards;
+    public:
+        concurrent_hash_map();
+
+        // size is the expected number of elements of the whole map
+        explicit concurrent_hash_map(size_t size);
+
+        ~concurrent_hash_map() = default;
+
+        inline bool Contains(const T& key);
+
+        // a copy of the value, the reference would outlive the lock
+        inline std::optional<U> Get(const T& key);
+
+        // inserts or overwrites, returns whether the key was inserted
+        template<typename V>
+        inline bool Insert(const T& key, V&& value);
+
+        // the value is constructed from args only if the key is absent, returns whether it was inserted
+        template<typename... Args>
+        inline bool TryEmplace(const T& key, Args&& ... args);
+
+        // inserts value if the key is absent, otherwise calls update(U&) on the present value,
+        // returns whether the key was inserted
+        template<typename V, typename Update>
+        inline bool Upsert(const T& key, V&& value, Update update);
+
+        // calls compute(U&) if the key is present, returns whether it was
+        template<typename Compute>
+        inline bool ComputeIfPresent(const T& key, Compute compute);
+
+        // returns whether the key was present
+        inline bool Delete(const T& key);
+
+        // calls visit(const T&, const U&) for every element, one shard at a time
+        template<typename Visit>
+        inline void ForEach(Visit visit);
+
+        // not a snapshot: the shards are counted one after another
+        inline size_t size();
+
+        inline void reserve(size_t size);
+    };
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::concurrent_hash_map():concurrent_hash_map(1) {
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::concurrent_hash_map(size_t size):shards(new Shard[Shards]) {
+        // the shards are picked and probed with the hash of the map, a seeded one included
+        for (size_t i = 0; i < Shards; ++i) {
+            shards[i].hashTable.SetHash(hash);
+        }
+        if (size > 1) {
+            reserve(size);
+        }
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::Contains(const T& key) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        ReadLock lock(shard.mutex);
+        return shard.hashTable.TryFind(key, h) != nullptr;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    std::optional<U> concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::Get(const T& key) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        ReadLock lock(shard.mutex);
+        if (auto pair = shard.hashTable.TryFind(key, h)) {
+            return pair->second;
+        }
+        return std::nullopt;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    template<typename V>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::Insert(const T& key, V&& value) {
+        return Upsert(key, std::forward<V>(value), [&value](U& present) { present = std::forward<V>(value); });
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    template<typename... Args>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::TryEmplace(const T& key, Args&& ... args) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        WriteLock lock(shard.mutex);
+        return shard.hashTable.template TryEmplaceHashed<KeyByValue>(
+                h, key, std::piecewise_construct, std::forward_as_tuple(key),
+                std::forward_as_tuple(std::forward<Args>(args)...)).second;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    template<typename V, typename Update>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::Upsert(const T& key, V&& value, Update update) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        WriteLock lock(shard.mutex);
+        auto [it, inserted] = shard.hashTable.template TryEmplaceHashed<KeyByValue>(
+                h, key, std::piecewise_construct, std::forward_as_tuple(key),
+                std::forward_as_tuple(std::forward<V>(value)));
+        if (!inserted) {
+            // value wasn't consumed by TryEmplaceHashed
+            update(it->second);
+        }
+        return inserted;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    template<typename Compute>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::ComputeIfPresent(const T& key, Compute compute) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        WriteLock lock(shard.mutex);
+        if (auto pair = shard.hashTable.TryFind(key, h)) {
+            compute(pair->second);
+            return true;
+        }
+        return false;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    bool concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::Delete(const T& key) {
+        auto h = hash(key);
+        auto& shard = shards[ShardOf(h)];
+        WriteLock lock(shard.mutex);
+        return shard.hashTable.Delete(key, h);
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    template<typename Visit>
+    void concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::ForEach(Visit visit) {
+        for (size_t i = 0; i < Shards; ++i) {
+            // begin() finishes the incremental migration
+            WriteLock lock(shards[i].mutex);
+            for (auto& pair: shards[i].hashTable) {
+                visit(pair.first, pair.second);
+            }
+        }
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    size_t concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::size() {
+        size_t size = 0;
+        for (size_t i = 0; i < Shards; ++i) {
+            std::shared_lock<std::shared_mutex> lock(shards[i].mutex);
+            size += shards[i].hashTable.size();
+        }
+        return size;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy, size_t Shards>
+    void concurrent_hash_map<T, U, Alloc, Hash, Policy, Shards>::reserve(size_t size) {
+        for (size_t i = 0; i < Shards; ++i) {
+            WriteLock lock(shards[i].mutex);
+            shards[i].hashTable.template Reserve<KeyByValue>(size / Shards + 1);
+        }
+    }
+
+    // hash map for read-mostly workloads: lookups never take a lock and never write memory shared with other
+    // threads, writers are serialized by a mutex. Slots hold the hash and a pointer to an immutable node, a write
+    // publishes a new node (a grow publishes new slots) and the replaced memory is freed through detail::epoch
+    // once no reader can see it. Only index, max_load_factor and growth_factor of Policy are used
+    template<typename T, typename U, typename Hash = hash<T>, typename Policy = hash_policy>
+    class read_mostly_hash_map {
+    private:
+        struct Node {
+            T key;
+            U value;
+        };
+
+        struct Slot {
+            std::atomic<size_t> hash;
+            // nullptr <=> empty, Tombstone() <=> deleted
+            std::atomic<Node*> node;
+        };
+
+        struct Table {
+            explicit Table(size_t capacity) : capacity(capacity), slots(new Slot[capacity]) {
+                for (size_t i = 0; i < capacity; ++i) {
+                    slots[i].hash.store(0, std::memory_order_relaxed);
+                    slots[i].node.store(nullptr, std::memory_order_relaxed);
+                }
+            }
+
+            size_t capacity;
+            std::unique_ptr<Slot[]> slots;
+        };
+
+        struct Retired {
+            uint64_t epoch;
+            void* pointer;
+            void (* destroy)(void*);
+        };
+
+        static inline Node* Tombstone() { return reinterpret_cast<Node*>(alignof(Node)); }
+
+        static inline size_t CapacityFor(size_t size) {
+            auto capacity = Policy::index::Capacity(
+                    std::max(static_cast<size_t>(static_cast<double>(size + 1) / Policy::max_load_factor),
+                             size_t{16}));
+            while (Limit(capacity) <= size) {
+                capacity = Policy::index::Capacity(capacity + 1);
+            }
+            return capacity;
+        }
+
+        static inline size_t Limit(size_t capacity) {
+            return static_cast<size_t>(static_cast<double>(capacity) * Policy::max_load_factor);
+        }
+
+        // the node of the key or nullptr, must be called under an epoch guard or the writer's lock
+        inline Node* FindNode(const Table& table, const T& key, size_t hash) const;
+
+        inline void Rehash(size_t capacity);
+
+        inline void Retire(void* pointer, void (* destroy)(void*));
+
+        inline void Reclaim();
+
+        static constexpr size_t npos = SIZE_MAX;
+
+        Hash hash;
+        std::atomic<Table*> table;
+
+        // owned by the writers
+        std::mutex writer;
+        size_t size_;
+        size_t tombstones;
+        std::vector<Retired> retired;
+    public:
+        read_mostly_hash_map();
+
+        explicit read_mostly_hash_map(size_t size);
+
+        // no thread may use the map at this point
+        ~read_mostly_hash_map();
+
+        inline bool Contains(const T& key);
+
+        inline std::optional<U> Get(const T& key);
+
+        // calls visit(const U&) while the value can't be freed, returns whether the key was present
+        template<typename Visitor>
+        inline bool Visit(const T& key, Visitor visit);
+
+        // inserts or overwrites, returns whether the key was inserted
+        inline bool Insert(const T& key, const U& value);
+
+        // returns whether the key was present
+        inline bool Delete(const T& key);
+
+        inline size_t size();
+    };
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    read_mostly_hash_map<T, U, Hash, Policy>::read_mostly_hash_map():read_mostly_hash_map(1) {
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    read_mostly_hash_map<T, U, Hash, Policy>::read_mostly_hash_map(size_t size):table(new Table(CapacityFor(size))),
+                                                                                  size_(0), tombstones(0) {
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    read_mostly_hash_map<T, U, Hash, Policy>::~read_mostly_hash_map() {
+        auto current = table.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < current->capacity; ++i) {
+            auto node = current->slots[i].node.load(std::memory_order_relaxed);
+            if (node && node != Tombstone()) {
+                delete node;
+            }
+        }
+        delete current;
+        for (auto& i: retired) {
+            i.destroy(i.pointer);
+        }
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    typename read_mostly_hash_map<T, U, Hash, Policy>::Node*
+    read_mostly_hash_map<T, U, Hash, Policy>::FindNode(const Table& table, const T& key, size_t hash) const {
+        auto pos = Policy::index::Index(hash, table.capacity);
+        // a write never clears a used slot, so the probe always ends at an empty one
+        while (true) {
+            auto& slot = table.slots[pos];
+            auto node = slot.node.load(std::memory_order_acquire);
+            if (node == nullptr) {
+                return nullptr;
+            }
+            if (node != Tombstone() && slot.hash.load(std::memory_order_relaxed) == hash && node->key == key) {
+                return node;
+            }
+            pos = pos + 1 == table.capacity ? 0 : pos + 1;
+        }
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    bool read_mostly_hash_map<T, U, Hash, Policy>::Contains(const T& key) {
+        detail::epoch::guard guard;
+        return FindNode(*table.load(std::memory_order_acquire), key, hash(key)) != nullptr;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    std::optional<U> read_mostly_hash_map<T, U, Hash, Policy>::Get(const T& key) {
+        detail::epoch::guard guard;
+        if (auto node = FindNode(*table.load(std::memory_order_acquire), key, hash(key))) {
+            return node->value;
+        }
+        return std::nullopt;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    template<typename Visitor>
+    bool read_mostly_hash_map<T, U, Hash, Policy>::Visit(const T& key, Visitor visit) {
+        detail::epoch::guard guard;
+        if (auto node = FindNode(*table.load(std::memory_order_acquire), key, hash(key))) {
+            visit(std::as_const(node->value));
+            return true;
+        }
+        return false;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    bool read_mostly_hash_map<T, U, Hash, Policy>::Insert(const T& key, const U& value) {
+        auto h = hash(key);
+        std::lock_guard<std::mutex> lock(writer);
+        auto current = table.load(std::memory_order_relaxed);
+        auto pos = Policy::index::Index(h, current->capacity);
+        auto free = npos;
+        while (true) {
+            auto& slot = current->slots[pos];
+            auto node = slot.node.load(std::memory_order_relaxed);
+            if (node == nullptr) {
+                break;
+            }
+            if (node == Tombstone()) {
+                if (free == npos) {
+                    free = pos;
+                }
+            } else if (slot.hash.load(std::memory_order_relaxed) == h && node->key == key) {
+                // the readers that have already loaded the old node keep reading it until they leave their epoch
+                slot.node.store(new Node{key, value}, std::memory_order_release);
+                Retire(node, [](void* pointer) { delete static_cast<Node*>(pointer); });
+                Reclaim();
+                return false;
+            }
+            pos = pos + 1 == current->capacity ? 0 : pos + 1;
+        }
+        if (free == npos) {
+            if (size_ + tombstones + 1 >= Limit(current->capacity)) {
+                // a table clogged with tombstones is rebuilt at the same capacity
+                Rehash(size_ + 1 >= Limit(current->capacity) >> 1u ?
+                       std::max(static_cast<size_t>(static_cast<double>(current->capacity) * Policy::growth_factor),
+                                current->capacity + 1) : current->capacity);
+                current = table.load(std::memory_order_relaxed);
+                free = Policy::index::Index(h, current->capacity);
+                while (current->slots[free].node.load(std::memory_order_relaxed) != nullptr) {
+                    free = free + 1 == current->capacity ? 0 : free + 1;
+                }
+            } else {
+                free = pos;
+            }
+        } else {
+            --tombstones;
+        }
+        // the hash is written first, a reader that sees the node sees its hash
+        current->slots[free].hash.store(h, std::memory_order_relaxed);
+        current->slots[free].node.store(new Node{key, value}, std::memory_order_release);
+        ++size_;
+        Reclaim();
+        return true;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    bool read_mostly_hash_map<T, U, Hash, Policy>::Delete(const T& key) {
+        auto h = hash(key);
+        std::lock_guard<std::mutex> lock(writer);
+        auto current = table.load(std::memory_order_relaxed);
+        auto node = FindNode(*current, key, h);
+        if (node == nullptr) {
+            return false;
+        }
+        auto pos = Policy::index::Index(h, current->capacity);
+        while (current->slots[pos].node.load(std::memory_order_relaxed) != node) {
+            pos = pos + 1 == current->capacity ? 0 : pos + 1;
+        }
+        current->slots[pos].node.store(Tombstone(), std::memory_order_release);
+        --size_;
+        ++tombstones;
+        Retire(node, [](void* pointer) { delete static_cast<Node*>(pointer); });
+        Reclaim();
+        return true;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    size_t read_mostly_hash_map<T, U, Hash, Policy>::size() {
+        std::lock_guard<std::mutex> lock(writer);
+        return size_;
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    void read_mostly_hash_map<T, U, Hash, Policy>::Rehash(size_t capacity) {
+        auto old = table.load(std::memory_order_relaxed);
+        auto grown = new Table(Policy::index::Capacity(capacity));
+        // the nodes are shared by both tables, only the slots are copied
+        for (size_t i = 0; i < old->capacity; ++i) {
+            auto node = old->slots[i].node.load(std::memory_order_relaxed);
+            if (node == nullptr || node == Tombstone()) {
+                continue;
+            }
+            auto h = old->slots[i].hash.load(std::memory_order_relaxed);
+            auto pos = Policy::index::Index(h, grown->capacity);
+            while (grown->slots[pos].node.load(std::memory_order_relaxed) != nullptr) {
+                pos = pos + 1 == grown->capacity ? 0 : pos + 1;
+            }
+            grown->slots[pos].hash.store(h, std::memory_order_relaxed);
+            grown->slots[pos].node.store(node, std::memory_order_relaxed);
+        }
+        tombstones = 0;
+        table.store(grown, std::memory_order_release);
+        Retire(old, [](void* pointer) { delete static_cast<Table*>(pointer); });
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    void read_mostly_hash_map<T, U, Hash, Policy>::Retire(void* pointer, void (* destroy)(void*)) {
+        retired.push_back({detail::epoch::Retire(), pointer, destroy});
+    }
+
+    template<typename T, typename U, typename Hash, typename Policy>
+    void read_mostly_hash_map<T, U, Hash, Policy>::Reclaim() {
+        if (retired.empty()) {
+            return;
+        }
+        auto min = detail::epoch::Min();
+        auto kept = std::remove_if(retired.begin(), retired.end(), [min](const Retired& i) {
+            if (i.epoch < min) {
+                i.destroy(i.pointer);
+                return true;
+            }
+            return false;
+        });
+        retired.erase(kept, retired.end());
+    }
+
+}
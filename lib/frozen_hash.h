@@ -0,0 +1,305 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "hash.h"
+
+namespace mtl {
+
+    namespace detail {
+
+        // murmur3 finalizer, a bijection of 64-bit values
+        constexpr uint64_t Mix64(uint64_t x) {
+            x ^= x >> 33u;
+            x *= 0xFF51AFD7ED558CCDull;
+            x ^= x >> 33u;
+            x *= 0xC4CEB9FE1A85EC53ull;
+            x ^= x >> 33u;
+            return x;
+        }
+
+    }
+
+    // Hash usable in constant expressions: integers, enums and everything convertible to std::string_view
+    template<typename T>
+    struct frozen_hash {
+        using is_transparent = void;
+
+        template<typename K>
+        constexpr size_t operator()(const K& key) const {
+            if constexpr (std::is_integral_v<K> || std::is_enum_v<K>) {
+                return detail::Mix64(static_cast<uint64_t>(key));
+            } else {
+                // FNV-1a
+                uint64_t hash = 0xCBF29CE484222325ull;
+                for (auto c: std::string_view(key)) {
+                    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001B3ull;
+                }
+                return detail::Mix64(hash);
+            }
+        }
+    };
+
+    namespace detail {
+
+        // immutable table over a minimal perfect hash (hash and displace, as in PTHash): the keys are split into
+        // buckets by their hash, every bucket gets a pilot such that the keys of all buckets land in distinct
+        // slots of a dense array of exactly size() elements. A lookup reads the pilot of the key's bucket,
+        // then one slot, and compares one key.
+        // N is the number of elements if it is known at compile time, the table then fits in constant expressions
+        template<typename Element, typename KeyOf, typename Hash, size_t N>
+        class FrozenTable {
+            template<typename X, size_t M>
+            using Storage = std::conditional_t<N == std::dynamic_extent, std::vector<X>, std::array<X, M>>;
+
+            static constexpr size_t Buckets(size_t size) { return size / 2 + 1; }
+
+        public:
+            template<typename Range>
+            constexpr explicit FrozenTable(Range&& range, Hash hash = Hash()) : hash(hash), seed(0) {
+                std::vector<Element> items;
+                for (auto&& element: range) {
+                    items.push_back(element);
+                }
+                if constexpr (N != std::dynamic_extent) {
+                    if (items.size() != N) {
+                        throw std::invalid_argument("frozen table built from a wrong number of elements");
+                    }
+                } else {
+                    elements.resize(items.size());
+                    pilots.resize(Buckets(items.size()));
+                }
+                Build(items);
+            }
+
+            // the only element that may hold the key, the table must not be empty
+            template<typename K>
+            constexpr const Element& Candidate(const K& key) const {
+                return elements[Slot(Reseed(hash(key)))];
+            }
+
+            template<typename K>
+            constexpr bool Contains(const K& key) const {
+                return !elements.empty() && KeyOf()(Candidate(key)) == key;
+            }
+
+            constexpr size_t size() const { return elements.size(); }
+
+            constexpr auto begin() const { return elements.begin(); }
+
+            constexpr auto end() const { return elements.end(); }
+
+            size_t memory_usage() const { return sizeof(Element) * elements.size() + sizeof(uint32_t) * pilots.size(); }
+
+        private:
+            // the first seed keeps the hash as is, the following ones remix it for another bucket split
+            constexpr uint64_t Reseed(uint64_t hash) const { return seed == 0 ? hash : Mix64(hash ^ seed); }
+
+            constexpr size_t Bucket(uint64_t hash) const { return MulHigh(hash, pilots.size()); }
+
+            // the bucket takes the high bits of the hash, the slot a mix of the hash and the pilot, so every pilot
+            // moves the keys of one bucket independently of each other
+            static constexpr size_t Position(uint64_t hash, uint32_t pilot, size_t size) {
+                return MulHigh(Mix64(hash ^ (pilot * 0x9E3779B97F4A7C15ull)), size);
+            }
+
+            constexpr size_t Slot(uint64_t hash) const {
+                return Position(hash, pilots[Bucket(hash)], elements.size());
+            }
+
+            constexpr void Build(std::vector<Element>& items) {
+                auto size = items.size();
+                if (size == 0) {
+                    return;
+                }
+                // equal hashes collide for every seed and pilot
+                std::vector<uint64_t> raw(size);
+                for (size_t i = 0; i < size; ++i) {
+                    raw[i] = hash(KeyOf()(items[i]));
+                }
+                std::vector<uint64_t> sorted(raw);
+                std::sort(sorted.begin(), sorted.end());
+                if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+                    throw std::invalid_argument("frozen table keys must be distinct and have distinct hashes");
+                }
+                for (;; ++seed) {
+                    if (TryBuild(items, raw)) {
+                        return;
+                    }
+                }
+            }
+
+            constexpr bool TryBuild(std::vector<Element>& items, const std::vector<uint64_t>& raw) {
+                auto size = items.size();
+                std::vector<uint64_t> hashes(size);
+                // the keys grouped by bucket, the largest buckets are placed first while most slots are free
+                std::vector<size_t> bucket_begin(pilots.size() + 1), keys(size);
+                for (size_t i = 0; i < size; ++i) {
+                    hashes[i] = Reseed(raw[i]);
+                    ++bucket_begin[Bucket(hashes[i]) + 1];
+                }
+                for (size_t b = 0; b < pilots.size(); ++b) {
+                    bucket_begin[b + 1] += bucket_begin[b];
+                }
+                {
+                    std::vector<size_t> fill(bucket_begin.begin(), bucket_begin.end() - 1);
+                    for (size_t i = 0; i < size; ++i) {
+                        keys[fill[Bucket(hashes[i])]++] = i;
+                    }
+                }
+                // counting sort of the buckets by size, descending
+                std::vector<size_t> order(pilots.size()), by_size(size + 2);
+                for (size_t b = 0; b < pilots.size(); ++b) {
+                    ++by_size[size - (bucket_begin[b + 1] - bucket_begin[b]) + 1];
+                }
+                for (size_t s = 0; s <= size; ++s) {
+                    by_size[s + 1] += by_size[s];
+                }
+                for (size_t b = 0; b < pilots.size(); ++b) {
+                    order[by_size[size - (bucket_begin[b + 1] - bucket_begin[b])]++] = b;
+                }
+
+                std::vector<size_t> slot_of(size, size);
+                std::vector<bool> taken(size);
+                for (auto b: order) {
+                    auto first = bucket_begin[b], last = bucket_begin[b + 1];
+                    if (first == last) {
+                        pilots[b] = 0;
+                        continue;
+                    }
+                    // the expected number of attempts grows with the share of taken slots, a bad seed is retried
+                    bool placed = false;
+                    for (uint32_t pilot = 0; !placed && pilot < 64 * size + 1024; ++pilot) {
+                        placed = true;
+                        for (auto k = first; k < last; ++k) {
+                            auto pos = Position(hashes[keys[k]], pilot, size);
+                            bool collides = taken[pos];
+                            for (auto j = first; !collides && j < k; ++j) {
+                                collides = slot_of[keys[j]] == pos;
+                            }
+                            if (collides) {
+                                placed = false;
+                                break;
+                            }
+                            slot_of[keys[k]] = pos;
+                        }
+                        if (placed) {
+                            pilots[b] = pilot;
+                            for (auto k = first; k < last; ++k) {
+                                taken[slot_of[keys[k]]] = true;
+                            }
+                        }
+                    }
+                    if (!placed) {
+                        return false;
+                    }
+                }
+                for (size_t i = 0; i < size; ++i) {
+                    elements[slot_of[i]] = items[i];
+                }
+                return true;
+            }
+
+            Hash hash;
+            uint64_t seed;
+            Storage<Element, N> elements{};
+            Storage<uint32_t, Buckets(N == std::dynamic_extent ? 0 : N)> pilots{};
+        };
+
+    }
+
+    // immutable map with single-probe lookups, built from a hash_map or any range of pairs,
+    // or in a constant expression with make_frozen_map. Keys must have distinct hashes
+    template<typename T, typename U, size_t N = std::dynamic_extent, typename Hash = frozen_hash<T>>
+    class frozen_map {
+    private:
+        struct KeyOf {
+            constexpr const T& operator()(const std::pair<T, U>& pair) const {
+                return pair.first;
+            }
+        };
+
+        detail::FrozenTable<std::pair<T, U>, KeyOf, Hash, N> table;
+
+        template<typename K>
+        constexpr const U* FindImpl(const K& key) const {
+            if (table.size() == 0) {
+                return nullptr;
+            }
+            auto& pair = table.Candidate(key);
+            return pair.first == key ? &pair.second : nullptr;
+        }
+    public:
+        template<typename Range>
+        constexpr explicit frozen_map(Range&& pairs) : table(std::forward<Range>(pairs)) {}
+
+        constexpr bool Contains(const T& key) const { return table.Contains(key); }
+
+        template<typename K> requires detail::transparent<Hash>
+        constexpr bool Contains(const K& key) const { return table.Contains(key); }
+
+        // the key must be present
+        constexpr const U& operator[](const T& key) const { return table.Candidate(key).second; }
+
+        template<typename K> requires detail::transparent<Hash>
+        constexpr const U& operator[](const K& key) const { return table.Candidate(key).second; }
+
+        // nullptr if there is no such key
+        constexpr const U* Find(const T& key) const { return FindImpl(key); }
+
+        template<typename K> requires detail::transparent<Hash>
+        constexpr const U* Find(const K& key) const { return FindImpl(key); }
+
+        constexpr auto begin() const { return table.begin(); }
+
+        constexpr auto end() const { return table.end(); }
+
+        constexpr size_t size() const { return table.size(); }
+
+        inline size_t memory_usage() const { return table.memory_usage(); }
+    };
+
+    template<typename T, size_t N = std::dynamic_extent, typename Hash = frozen_hash<T>>
+    class frozen_set {
+    private:
+        struct KeyOf {
+            constexpr const T& operator()(const T& element) const {
+                return element;
+            }
+        };
+
+        detail::FrozenTable<T, KeyOf, Hash, N> table;
+    public:
+        template<typename Range>
+        constexpr explicit frozen_set(Range&& values) : table(std::forward<Range>(values)) {}
+
+        constexpr bool Contains(const T& value) const { return table.Contains(value); }
+
+        template<typename K> requires detail::transparent<Hash>
+        constexpr bool Contains(const K& value) const { return table.Contains(value); }
+
+        constexpr auto begin() const { return table.begin(); }
+
+        constexpr auto end() const { return table.end(); }
+
+        constexpr size_t size() const { return table.size(); }
+
+        inline size_t memory_usage() const { return table.memory_usage(); }
+    };
+
+    template<typename T, typename U, size_t N>
+    constexpr frozen_map<T, U, N> make_frozen_map(const std::pair<T, U> (& pairs)[N]) {
+        return frozen_map<T, U, N>(pairs);
+    }
+
+    template<typename T, size_t N>
+    constexpr frozen_set<T, N> make_frozen_set(const T (& values)[N]) {
+        return frozen_set<T, N>(values);
+    }
+
+}
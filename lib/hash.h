@@ -1,22 +1,709 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <algorithm>
+#include <functional>
 #include <memory>
+#include <random>
+#include <source_location>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MTL_HASH_MMAP
+#endif
+
+#if !defined(MTL_HASH_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define MTL_HASH_AVX2
+#elif !defined(MTL_HASH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define MTL_HASH_SSE2
+#endif
 
 namespace mtl {
 
-    template<typename T, typename U, typename Compare, typename Alloc = std::allocator<U>, typename Hash = std::hash<T>>
+    namespace detail {
+
+        // control byte of every slot: kEmpty <=> not ever used, kDeleted <=> was used and now is free,
+        // 0b0xxxxxxx <=> currently in use, the low 7 bits hold a fragment of the element's hash (H2)
+        constexpr int8_t kEmpty = -128;
+        constexpr int8_t kDeleted = -2;
+
+        // in the Robin Hood mode the control byte of a used slot holds its distance from the home slot instead
+        constexpr int kMaxDistance = 127;
+
+        inline void Prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(address);
+#elif defined(MTL_HASH_SSE2) || defined(MTL_HASH_AVX2)
+            _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+        }
+
+        // runs task(0) .. task(tasks - 1) on as many threads, task(0) on the calling one
+        template<typename Task>
+        inline void ParallelFor(size_t tasks, Task task) {
+            std::vector<std::thread> threads;
+            for (size_t i = 1; i < tasks; ++i) {
+                threads.emplace_back(std::ref(task), i);
+            }
+            task(0);
+            for (auto& thread: threads) {
+                thread.join();
+            }
+        }
+
+        // FNV-1a of the signature of this function, which names X; differs between all the table types
+        template<typename X>
+        inline uint64_t TypeFingerprint() {
+            uint64_t hash = 0xCBF29CE484222325ull;
+            for (auto c = std::source_location::current().function_name(); *c; ++c) {
+                hash = (hash ^ static_cast<uint8_t>(*c)) * 0x100000001B3ull;
+            }
+            return hash;
+        }
+
+        // the elements that Save can write byte by byte
+        template<typename U>
+        constexpr bool kTriviallyCopyable = std::is_trivially_copyable_v<U>;
+
+        // std::pair is not trivially copyable because of its assignment operators, but with trivially copyable
+        // members its copy constructor and destructor are trivial: a pair read from the bytes of a snapshot is
+        // the same as a copy of the pair that was written
+        template<typename T, typename U>
+        constexpr bool kTriviallyCopyable<std::pair<T, U>> =
+                std::is_trivially_copyable_v<T> && std::is_trivially_copyable_v<U> &&
+                std::is_trivially_copy_constructible_v<std::pair<T, U>> &&
+                std::is_trivially_destructible_v<std::pair<T, U>>;
+
+        // file written by HashTable::Save: the header, the control bytes, the slots and the stored hashes,
+        // every part starts at a multiple of kSnapshotAlign
+        struct SnapshotHeader {
+            static constexpr char kMagic[8] = {'M', 'T', 'L', 'H', 'A', 'S', 'H', '\0'};
+            static constexpr uint64_t kVersion = 2;
+
+            char magic[8];
+            uint64_t version;
+            uint64_t layout;// fingerprint of the table type, the group width and the slot size
+            uint64_t capacity;
+            uint64_t size;
+            uint64_t tombstones;
+            uint64_t seed;// of a seeded Hash, the mapping table adopts it
+        };
+
+        constexpr size_t kSnapshotAlign = 64;
+
+        inline size_t AlignSnapshot(size_t offset) { return (offset + kSnapshotAlign - 1) / kSnapshotAlign * kSnapshotAlign; }
+
+        // the whole file in memory: a private copy-on-write mapping, or a plain copy without mmap
+        inline void* MapFile(const char* path, size_t& size) {
+#if defined(MTL_HASH_MMAP)
+            auto fd = ::open(path, O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+            struct stat st{};
+            void* mapping = nullptr;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+                size = static_cast<size_t>(st.st_size);
+                mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    mapping = nullptr;
+                }
+            }
+            ::close(fd);
+            return mapping;
+#else
+            auto file = std::fopen(path, "rb");
+            if (!file) {
+                return nullptr;
+            }
+            void* mapping = nullptr;
+            if (std::fseek(file, 0, SEEK_END) == 0 && std::ftell(file) > 0) {
+                size = static_cast<size_t>(std::ftell(file));
+                std::rewind(file);
+                mapping = ::operator new(size, std::align_val_t(kSnapshotAlign));
+                if (std::fread(mapping, 1, size, file) != size) {
+                    ::operator delete(mapping, std::align_val_t(kSnapshotAlign));
+                    mapping = nullptr;
+                }
+            }
+            std::fclose(file);
+            return mapping;
+#endif
+        }
+
+        inline void UnmapFile(void* mapping, size_t size) {
+#if defined(MTL_HASH_MMAP)
+            ::munmap(mapping, size);
+#else
+            ::operator delete(mapping, std::align_val_t(kSnapshotAlign));
+#endif
+        }
+
+        inline size_t DefaultThreads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+        inline int8_t H2(size_t hash) {
+            return static_cast<int8_t>((hash * 0xC2B2AE3D27D4EB4Full) >> 57u);
+        }
+
+        // Hash and Compare that accept any key type comparable with the stored one
+        template<typename Hash>
+        concept transparent = requires { typename Hash::is_transparent; };
+
+        // high 64 bits of a 128-bit product
+        constexpr uint64_t MulHigh(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+            return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64u);
+#else
+            uint64_t a_lo = a & 0xFFFFFFFFull, a_hi = a >> 32u, b_lo = b & 0xFFFFFFFFull, b_hi = b >> 32u;
+            uint64_t mid = a_hi * b_lo + ((a_lo * b_lo) >> 32u);
+            return a_hi * b_hi + (mid >> 32u) + ((a_lo * b_hi + (mid & 0xFFFFFFFFull)) >> 32u);
+#endif
+        }
+
+        // the 128-bit product of a and b with its halves xor-ed together
+        inline uint64_t MulFold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+            auto product = static_cast<unsigned __int128>(a) * b;
+            return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64u);
+#else
+            return a * b ^ MulHigh(a, b);
+#endif
+        }
+
+        // the constants of wyhash
+        constexpr uint64_t kHashSecret[4] = {0x2D358DCCAA6C78A5ull, 0x8BB84B93962EACC9ull, 0x4B33A62ED433D4A3ull,
+                                             0x4D5A2DA51DE1AA47ull};
+
+        inline uint64_t Read8(const char* p) {
+            uint64_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        inline uint64_t Read4(const char* p) {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        // the product of the two halves of the first fold brings the high bits of the key down to the low ones
+        inline uint64_t HashWord(uint64_t key, uint64_t seed) {
+            auto mixed = MulFold(key ^ kHashSecret[0], seed ^ kHashSecret[1]);
+            return MulFold(mixed ^ kHashSecret[2], (mixed >> 32u | mixed << 32u) ^ kHashSecret[3]);
+        }
+
+        // wyhash (final version 4): up to 16 bytes are read with a few overlapping loads, longer inputs are
+        // consumed 48 bytes at a time by three independent multiplication chains
+        inline uint64_t HashBytes(const char* p, size_t length, uint64_t seed) {
+            seed ^= MulFold(seed ^ kHashSecret[0], kHashSecret[1]);
+            uint64_t a, b;
+            if (length <= 16) {
+                if (length >= 4) {
+                    auto shift = (length >> 3u) << 2u;
+                    a = (Read4(p) << 32u) | Read4(p + shift);
+                    b = (Read4(p + length - 4) << 32u) | Read4(p + length - 4 - shift);
+                } else if (length > 0) {
+                    a = (uint64_t(uint8_t(p[0])) << 16u) | (uint64_t(uint8_t(p[length >> 1u])) << 8u) |
+                        uint8_t(p[length - 1]);
+                    b = 0;
+                } else {
+                    a = b = 0;
+                }
+            } else {
+                auto left = length;
+                if (left > 48) {
+                    auto see1 = seed, see2 = seed;
+                    do {
+                        seed = MulFold(Read8(p) ^ kHashSecret[1], Read8(p + 8) ^ seed);
+                        see1 = MulFold(Read8(p + 16) ^ kHashSecret[2], Read8(p + 24) ^ see1);
+                        see2 = MulFold(Read8(p + 32) ^ kHashSecret[3], Read8(p + 40) ^ see2);
+                        p += 48;
+                        left -= 48;
+                    } while (left > 48);
+                    seed ^= see1 ^ see2;
+                }
+                while (left > 16) {
+                    seed = MulFold(Read8(p) ^ kHashSecret[1], Read8(p + 8) ^ seed);
+                    p += 16;
+                    left -= 16;
+                }
+                a = Read8(p + left - 16);
+                b = Read8(p + left - 8);
+            }
+            a ^= kHashSecret[1];
+            b ^= seed;
+#if defined(__SIZEOF_INT128__)
+            auto product = static_cast<unsigned __int128>(a) * b;
+            a = static_cast<uint64_t>(product);
+            b = static_cast<uint64_t>(product >> 64u);
+#else
+            auto low = a * b;
+            b = MulHigh(a, b);
+            a = low;
+#endif
+            return MulFold(a ^ kHashSecret[0] ^ length, b ^ kHashSecret[1]);
+        }
+
+        template<typename K>
+        concept string_like = std::is_convertible_v<const K&, std::string_view>;
+
+        template<typename K>
+        concept tuple_like = requires { std::tuple_size<K>::value; };
+
+        template<typename K>
+        inline size_t HashValue(const K& key, uint64_t seed) {
+            if constexpr (string_like<K>) {
+                std::string_view bytes(key);
+                return HashBytes(bytes.data(), bytes.size(), seed);
+            } else if constexpr (std::is_integral_v<K> || std::is_enum_v<K>) {
+                return HashWord(static_cast<uint64_t>(key), seed);
+            } else if constexpr (std::is_pointer_v<K>) {
+                return HashWord(reinterpret_cast<uintptr_t>(key), seed);
+            } else if constexpr (tuple_like<K>) {
+                return std::apply([seed](const auto& ... elements) {
+                    uint64_t hash = seed;
+                    ((hash = MulFold(hash ^ kHashSecret[2], HashValue(elements, seed) ^ kHashSecret[3])), ...);
+                    return hash;
+                }, key);
+            } else {
+                return HashWord(std::hash<K>()(key), seed);
+            }
+        }
+
+        // differs between the calls and between the processes
+        inline uint64_t RandomSeed() {
+            static const uint64_t base = (uint64_t(std::random_device()()) << 32u) ^ std::random_device()() ^
+                                         std::chrono::steady_clock::now().time_since_epoch().count();
+            static std::atomic<uint64_t> counter{0};
+            return HashWord(counter.fetch_add(1, std::memory_order_relaxed), base);
+        }
+
+        // the string hashes accept any string-like key, they hash as its std::string_view
+        template<typename T>
+        struct StringTransparency {
+        };
+
+        template<string_like T>
+        struct StringTransparency<T> {
+            using is_transparent = void;
+        };
+
+        template<typename Hash>
+        concept seeded = requires(const Hash& hash) {
+            { hash.seed() } -> std::convertible_to<uint64_t>;
+            Hash(uint64_t{});
+        };
+
+        constexpr uint64_t kPrimes[] = {
+                17ull, 37ull, 67ull, 131ull,
+                257ull, 521ull, 1031ull, 2053ull,
+                4099ull, 8209ull, 16411ull, 32771ull,
+                65537ull, 131101ull, 262147ull, 524309ull,
+                1048583ull, 2097169ull, 4194319ull, 8388617ull,
+                16777259ull, 33554467ull, 67108879ull, 134217757ull,
+                268435459ull, 536870923ull, 1073741827ull, 2147483659ull,
+                4294967311ull, 8589934609ull, 17179869209ull, 34359738421ull,
+                68719476767ull, 137438953481ull, 274877906951ull, 549755813911ull,
+                1099511627791ull, 2199023255579ull, 4398046511119ull, 8796093022237ull,
+                17592186044423ull, 35184372088891ull, 70368744177679ull, 140737488355333ull,
+                281474976710677ull, 562949953421381ull, 1125899906842679ull, 2251799813685269ull,
+                4503599627370517ull, 9007199254740997ull, 18014398509482143ull, 36028797018963971ull,
+                72057594037928017ull, 144115188075855881ull, 288230376151711813ull, 576460752303423619ull,
+                1152921504606847009ull, 2305843009213693967ull, 4611686018427388039ull, 9223372036854775837ull,
+        };
+
+        // set of slots inside a group, every slot is represented by 2^Shift bits of Mask
+        template<typename Mask, uint32_t Width, uint32_t Shift>
+        class BitMask {
+        public:
+            explicit BitMask(Mask mask) : mask(mask) {}
+
+            inline explicit operator bool() const { return mask != 0; }
+
+            inline BitMask& operator++() {
+                mask &= mask - 1;
+                return *this;
+            }
+
+            inline uint32_t operator*() const { return LowestBitSet(); }
+
+            inline BitMask begin() const { return *this; }
+
+            inline BitMask end() const { return BitMask(0); }
+
+            inline bool operator==(const BitMask& other) const { return mask == other.mask; }
+
+            inline uint32_t LowestBitSet() const { return std::countr_zero(mask) >> Shift; }
+
+            // number of slots before the first set one, Width if there is none
+            inline uint32_t TrailingZeros() const { return std::min<uint32_t>(std::countr_zero(mask) >> Shift, Width); }
+
+            // number of slots after the last set one, Width if there is none
+            inline uint32_t LeadingZeros() const {
+                return std::min<uint32_t>((std::countl_zero(mask) - (sizeof(Mask) * 8 - (Width << Shift))) >> Shift,
+                                          Width);
+            }
+
+        private:
+            Mask mask;
+        };
+
+#if defined(MTL_HASH_AVX2)
+
+        class Group {
+        public:
+            static constexpr size_t kWidth = 32;
+
+            using Mask = BitMask<uint32_t, kWidth, 0>;
+
+            explicit Group(const int8_t* pos) : ctrl(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos))) {}
+
+            inline Mask Match(int8_t h2) const {
+                return Mask(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_set1_epi8(h2), ctrl))));
+            }
+
+            inline Mask MatchEmpty() const { return Match(kEmpty); }
+
+            inline Mask MatchEmptyOrDeleted() const { return Mask(static_cast<uint32_t>(_mm256_movemask_epi8(ctrl))); }
+
+            inline Mask MatchFull() const { return Mask(~static_cast<uint32_t>(_mm256_movemask_epi8(ctrl))); }
+
+        private:
+            __m256i ctrl;
+        };
+
+#elif defined(MTL_HASH_SSE2)
+
+        class Group {
+        public:
+            static constexpr size_t kWidth = 16;
+
+            using Mask = BitMask<uint16_t, kWidth, 0>;
+
+            explicit Group(const int8_t* pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+            inline Mask Match(int8_t h2) const {
+                return Mask(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl))));
+            }
+
+            inline Mask MatchEmpty() const { return Match(kEmpty); }
+
+            inline Mask MatchEmptyOrDeleted() const { return Mask(static_cast<uint16_t>(_mm_movemask_epi8(ctrl))); }
+
+            inline Mask MatchFull() const { return Mask(static_cast<uint16_t>(~_mm_movemask_epi8(ctrl))); }
+
+        private:
+            __m128i ctrl;
+        };
+
+#else
+
+        // portable fallback: 8 control bytes are processed at once inside a 64-bit word
+        class Group {
+        public:
+            static constexpr size_t kWidth = 8;
+
+            using Mask = BitMask<uint64_t, kWidth, 3>;
+
+            explicit Group(const int8_t* pos) {
+                std::memcpy(&ctrl, pos, sizeof(ctrl));
+                if constexpr (std::endian::native == std::endian::big) {
+                    ctrl = __builtin_bswap64(ctrl);
+                }
+            }
+
+            // may report a false positive right after a true match, Compare filters it out
+            inline Mask Match(int8_t h2) const {
+                auto x = ctrl ^ (kLsbs * static_cast<uint8_t>(h2));
+                return Mask((x - kLsbs) & ~x & kMsbs);
+            }
+
+            inline Mask MatchEmpty() const { return Mask(ctrl & ~(ctrl << 6u) & kMsbs); }
+
+            inline Mask MatchEmptyOrDeleted() const { return Mask(ctrl & kMsbs); }
+
+            inline Mask MatchFull() const { return Mask(~ctrl & kMsbs); }
+
+        private:
+            static constexpr uint64_t kLsbs = 0x0101010101010101ull;
+            static constexpr uint64_t kMsbs = 0x8080808080808080ull;
+
+            uint64_t ctrl;
+        };
+
+#endif
+
+    }
+
+    // the default Hash of the tables. Integers, enums and pointers are mixed by a 128-bit multiplication, so
+    // sequential and strided ids spread over all the bits; strings are hashed by wyhash; pairs, tuples and arrays
+    // combine the hashes of their elements; other types mix the result of std::hash<T>, or specialize mtl::hash.
+    // A string hashes as its std::string_view, the string tables accept std::string_view and const char* keys
+    template<typename T>
+    struct hash : detail::StringTransparency<T> {
+        inline size_t operator()(const T& key) const { return detail::HashValue(key, 0); }
+
+        template<typename K> requires detail::string_like<T> && detail::string_like<K>
+        inline size_t operator()(const K& key) const { return detail::HashValue(std::string_view(key), 0); }
+    };
+
+    // mtl::hash with a seed of its own, random unless given: keys crafted to collide in one table do not collide
+    // in another. The tables keep it through rehashes and in snapshots
+    template<typename T>
+    class seeded_hash : public detail::StringTransparency<T> {
+    public:
+        seeded_hash() : seed_(detail::RandomSeed()) {}
+
+        explicit seeded_hash(uint64_t seed) : seed_(seed) {}
+
+        inline size_t operator()(const T& key) const { return detail::HashValue(key, seed_); }
+
+        template<typename K> requires detail::string_like<T> && detail::string_like<K>
+        inline size_t operator()(const K& key) const { return detail::HashValue(std::string_view(key), seed_); }
+
+        inline uint64_t seed() const { return seed_; }
+
+    private:
+        uint64_t seed_;
+    };
+
+    // transparent hash of strings, allows std::string_view and const char* lookups in std::string containers
+    struct string_hash : hash<std::string_view> {
+    };
+
+    // index policies map the hash of a key to its home slot and decide which capacities are allowed:
+    // Capacity(n) returns the smallest allowed capacity that is not less than n
+
+    // power of two capacity, the hash is mixed before its low bits are taken so identity hashes don't cluster
+    struct mask_index {
+        static constexpr size_t Capacity(size_t capacity) { return std::bit_ceil(capacity); }
+
+        static inline size_t Index(size_t hash, size_t capacity) {
+            hash ^= hash >> 33u;
+            hash *= 0xFF51AFD7ED558CCDull;
+            hash ^= hash >> 33u;
+            return hash & (capacity - 1);
+        }
+    };
+
+    // any capacity, multiply-shift of the hash by the capacity (Lemire's fastrange) instead of a division
+    struct fastrange_index {
+        static constexpr size_t Capacity(size_t capacity) { return capacity; }
+
+        static inline size_t Index(size_t hash, size_t capacity) {
+            return detail::MulHigh(hash * 0x9E3779B97F4A7C15ull, capacity);
+        }
+    };
+
+    // prime capacity and plain modulo: the slowest one, but it spreads even a poor hash function well
+    struct prime_index {
+        static constexpr size_t Capacity(size_t capacity) {
+            auto prime = std::lower_bound(std::begin(detail::kPrimes), std::end(detail::kPrimes), capacity);
+            return prime == std::end(detail::kPrimes) ? capacity : *prime;
+        }
+
+        static inline size_t Index(size_t hash, size_t capacity) { return hash % capacity; }
+    };
+
+    // storage and probing options of HashTable, derive from it to override some of them
+    struct hash_policy {
+        // how a hash is mapped to a slot: mask_index, fastrange_index or prime_index
+        using index = mask_index;
+
+        // the table grows when its elements and tombstones take this share of the slots,
+        // higher values save memory at the cost of longer probe sequences
+        static constexpr double max_load_factor = 0.5;
+
+        // capacity multiplier of a grow, the index policy may round the result up
+        static constexpr double growth_factor = 2.0;
+
+        // keep the full hash of every element in a separate array: Rehash does not call Hash
+        // and lookups skip Compare for the elements with another hash
+        static constexpr bool store_hash = false;
+
+        // Robin Hood linear probing: an element being inserted takes the slot of an element that is closer to
+        // its home slot, Delete shifts the following elements back instead of leaving tombstones.
+        // There must be less than 128 elements with the same home slot
+        static constexpr bool robin_hood = false;
+
+        // number of slots moved to the grown arrays on every operation, 0 <=> the table grows at once.
+        // Until the migration finishes the old arrays are kept and lookups consult both, iteration and
+        // the explicit Rehash finish it first. Not supported together with robin_hood
+        static constexpr size_t incremental_rehash = 0;
+
+        // count probe lengths and rehashes, see hash_stats. Costs nothing when false
+        static constexpr bool collect_stats = false;
+
+        // number of elements kept in arrays inside the table object, the arrays are allocated only when
+        // the table grows beyond it (and given back when it shrinks below it). 0 <=> always allocated
+        static constexpr size_t inline_capacity = 0;
+    };
+
+    struct robin_hood_policy : hash_policy {
+        static constexpr bool robin_hood = true;
+    };
+
+    // what a table with Policy::collect_stats has seen since its construction
+    struct hash_stats {
+        static constexpr size_t kProbeBuckets = 16;
+
+        // probe length: the groups of control bytes (slots in the Robin Hood mode) that a lookup or an insert
+        // looked into. probes[i] counts the probes of length i + 1, the last bucket also counts all the longer ones.
+        // Only the current arrays are counted: during an incremental rehash a key found in the old ones is a miss
+        std::array<uint64_t, kProbeBuckets> hit_probes{};
+        std::array<uint64_t, kProbeBuckets> miss_probes{};
+        size_t max_probe = 0;
+
+        // grows, shrinks and explicit rehashes
+        uint64_t rehashes = 0;
+        uint64_t rehash_ns = 0;
+
+        // in-place reclamations of tombstones (DropTombstones)
+        uint64_t cleanups = 0;
+        uint64_t cleanup_ns = 0;
+
+        // slots of the current arrays at the time of the snapshot
+        size_t occupied = 0;
+        size_t tombstones = 0;
+        size_t empty = 0;
+
+        inline void Probed(size_t probes, bool hit) {
+            ++(hit ? hit_probes : miss_probes)[std::min(probes, kProbeBuckets) - 1];
+            max_probe = std::max(max_probe, probes);
+        }
+
+        // one "name value" line per counter (the Prometheus text format), names start with prefix
+        void Dump(FILE* out, const char* prefix = "mtl_hash") const;
+    };
+
+    inline void hash_stats::Dump(FILE* out, const char* prefix) const {
+        for (auto [name, probes]: {std::pair{"hit", &hit_probes}, std::pair{"miss", &miss_probes}}) {
+            for (size_t i = 0; i < kProbeBuckets; ++i) {
+                std::fprintf(out, "%s_%s_probes{length=\"%zu%s\"} %llu\n", prefix, name, i + 1,
+                             i + 1 == kProbeBuckets ? "+" : "", static_cast<unsigned long long>((*probes)[i]));
+            }
+        }
+        std::fprintf(out, "%s_max_probe %zu\n", prefix, max_probe);
+        std::fprintf(out, "%s_rehashes %llu\n", prefix, static_cast<unsigned long long>(rehashes));
+        std::fprintf(out, "%s_rehash_seconds %.9f\n", prefix, static_cast<double>(rehash_ns) * 1e-9);
+        std::fprintf(out, "%s_cleanups %llu\n", prefix, static_cast<unsigned long long>(cleanups));
+        std::fprintf(out, "%s_cleanup_seconds %.9f\n", prefix, static_cast<double>(cleanup_ns) * 1e-9);
+        std::fprintf(out, "%s_occupied_slots %zu\n", prefix, occupied);
+        std::fprintf(out, "%s_tombstone_slots %zu\n", prefix, tombstones);
+        std::fprintf(out, "%s_empty_slots %zu\n", prefix, empty);
+    }
+
+    namespace detail {
+
+        // the stats of a table without Policy::collect_stats
+        struct NoStats {
+            inline void Probed(size_t, bool) {}
+        };
+
+        // adds the time of its scope to the rehash or to the cleanup counters
+        template<typename Stats>
+        class StatsTimer {
+        public:
+            StatsTimer(Stats& stats, bool rehash) : stats(stats), rehash(rehash),
+                                                    start(std::chrono::steady_clock::now()) {}
+
+            ~StatsTimer() {
+                auto ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+                ++(rehash ? stats.rehashes : stats.cleanups);
+                (rehash ? stats.rehash_ns : stats.cleanup_ns) += ns;
+            }
+
+        private:
+            Stats& stats;
+            bool rehash;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        template<>
+        class StatsTimer<NoStats> {
+        public:
+            StatsTimer(NoStats&, bool) {}
+        };
+
+        template<typename Policy>
+        constexpr size_t Limit(size_t capacity) {
+            return static_cast<size_t>(static_cast<double>(capacity) * Policy::max_load_factor);
+        }
+
+        // the smallest allowed capacity that holds size elements below the maximum load factor
+        template<typename Policy>
+        constexpr size_t CapacityFor(size_t size) {
+            auto capacity = Policy::index::Capacity(
+                    std::max(static_cast<size_t>(static_cast<double>(size + 1) / Policy::max_load_factor),
+                             Group::kWidth));
+            while (Limit<Policy>(capacity) <= size) {
+                capacity = Policy::index::Capacity(capacity + 1);
+            }
+            return capacity;
+        }
+
+        // the arrays of a table of Slots slots inside the table object, see hash_policy::inline_capacity
+        template<typename U, size_t Slots, bool StoreHash>
+        struct InlineArrays {
+            alignas(U) std::byte array[Slots * sizeof(U)];
+            int8_t ctrl[Slots + Group::kWidth];
+            size_t hashes[StoreHash ? Slots : 1];
+            bool used = false;
+        };
+
+        template<typename U, bool StoreHash>
+        struct InlineArrays<U, 0, StoreHash> {
+        };
+
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc = std::allocator<U>, typename Hash = hash<T>,
+            typename Policy = hash_policy>
     class HashTable {
+        static_assert(!Policy::robin_hood || !Policy::incremental_rehash,
+                      "incremental rehash relies on tombstones, it can't be used with robin_hood");
+        static_assert(Policy::max_load_factor > 0 && Policy::max_load_factor < 1,
+                      "max_load_factor must leave empty slots to end the probe sequences");
+        static_assert(Policy::growth_factor > 1, "growth_factor must grow the table");
     public:
 
         struct HashTable_impl : public Alloc, public Hash {
-            U* array;
-            size_t size;
-            size_t capacity;
-            int8_t* deleted;// -1 <=> not ever used, 0 <=> currently in use, 1 <=> was used and now is free
-            Compare compare;
+            HashTable_impl(const Alloc& alloc, const Hash& hash) : Alloc(alloc), Hash(hash) {}
+
+            U* array = nullptr;
+            size_t size = 0;
+            size_t capacity = 0;
+            size_t tombstones = 0;
+            size_t limit = 0;// the table grows when size + tombstones reach it
+            // capacity + Group::kWidth bytes, the last ones mirror the first Group::kWidth,
+            // a table narrower than a group keeps them empty and is scanned at once
+            int8_t* ctrl = nullptr;
+            size_t* hashes = nullptr;// nullptr unless Policy::store_hash
+            Compare compare{};
+            void* mapping = nullptr;// the arrays live in this file mapping instead of the allocator's memory, see MapFromFile
+            size_t mapping_size = 0;
         };
 
         class iterator {
@@ -47,6 +734,8 @@ namespace mtl {
 
             inline U* operator->() { return hashTable->array + idx; }
 
+            inline size_t index() const { return idx; }
+
         private:
             size_t idx;
 
@@ -54,7 +743,7 @@ namespace mtl {
         };
 
 
-        explicit HashTable(size_t size, Alloc alloc = Alloc());
+        explicit HashTable(size_t size, Alloc alloc = Alloc(), Hash hash = Hash());
 
         HashTable(const HashTable& other) = delete;
 
@@ -68,240 +757,1301 @@ namespace mtl {
         template<typename KeyByValue>
         void Insert(const T& key, U&& value);
 
-        void Delete(const T& key);
+        // the lookup methods take any key type K that Hash and Compare accept
+        // returns whether the key was present
+        template<typename K>
+        bool Delete(const K& key) { return Delete(key, impl(key)); }
+
+        template<typename K>
+        bool Delete(const K& key, size_t hash);
+
+        template<typename K>
+        size_t HashOf(const K& key) { return impl(key); }
+
+        inline const Hash& HashFunction() const { return impl; }
+
+        inline const Alloc& Allocator() const { return impl; }
+
+        // the hash kept for an element of the arrays
+        inline size_t StoredHash(const U* element) const requires Policy::store_hash {
+            return impl.hashes[element - impl.array];
+        }
+
+        // only while the table is empty, the elements are not moved
+        inline void SetHash(const Hash& hash) { static_cast<Hash&>(impl) = hash; }
 
         template<typename KeyByValue>
         inline void Rehash(size_t new_size, KeyByValue keyByValue);
 
+        // same as Rehash, the elements are placed into the new arrays by threads threads
+        template<typename KeyByValue>
+        void RehashParallel(size_t new_size, size_t threads);
+
+        // grows the table so that size elements fit in without a Rehash, the elements are moved by threads threads
+        template<typename KeyByValue>
+        void Reserve(size_t size, size_t threads = 1);
+
+        // writes the arrays into a file that MapFromFile maps back, returns whether it succeeded
+        bool Save(const char* path);
+
+        // replaces the arrays with a copy-on-write mapping of a file written by Save for the same table type,
+        // lookups read the mapped pages in place. Returns false and keeps the table if the file does not match
+        bool MapFromFile(const char* path);
+
+        // inserts n elements like Insert does, source(i) points to the i-th of them or is nullptr to skip it,
+        // non-const elements are moved from. The table is grown once and filled by threads threads
+        template<typename KeyByValue, typename Source>
+        void InsertParallel(size_t n, Source source, size_t threads);
+
+        // same as InsertParallel, but hash_of(i) is the hash of the i-th element and an element whose key is
+        // present is handed to merge(present, element) instead of replacing it
+        template<typename KeyByValue, typename Source, typename HashBy, typename Merge>
+        void MergeParallel(size_t n, Source source, HashBy hash_of, Merge merge, size_t threads);
+
+        // moves the elements into the smallest table that fits them
+        template<typename KeyByValue>
+        void ShrinkToFit();
+
+        // reclaims the tombstones inside the current arrays, no memory is allocated
+        template<typename KeyByValue>
+        void DropTombstones(KeyByValue keyByValue);
+
         inline size_t Capacity() { return impl.capacity; };
 
-        bool Contains(const T& key);
+        template<typename K>
+        bool Contains(const K& key);
+
+        // throws std::out_of_range if there is no such key
+        template<typename K>
+        U& Find(const K& key);
+
+        // nullptr if there is no such key
+        template<typename K>
+        U* TryFind(const K& key) { return TryFind(key, impl(key)); }
+
+        template<typename K>
+        U* TryFind(const K& key, size_t hash);
+
+        // constructs U from args in the slot of key if the key is not present yet, with a single probe sequence.
+        // Returns the iterator to the element with the key and whether it was inserted. args are untouched if the
+        // key is present; key is not read once U is constructed, so args may move it into the element
+        template<typename KeyByValue, typename K, typename... Args>
+        std::pair<iterator, bool> TryEmplace(const K& key, Args&& ... args) {
+            return TryEmplaceHashed<KeyByValue>(impl(key), key, std::forward<Args>(args)...);
+        }
+
+        template<typename KeyByValue, typename K, typename... Args>
+        std::pair<iterator, bool> TryEmplaceHashed(size_t hash, const K& key, Args&& ... args);
+
+        // calls visit(i, hash) for i in [0, n), key(i) is hashed and its home slot is prefetched kBatch elements
+        // ahead, so the cache misses of a whole chunk are in flight at once
+        template<typename Key, typename Visit>
+        inline void Batch(size_t n, Key key, Visit visit);
+
+        // calls visit(t, elements, n) with pointers to up to kBatch elements at a time, the slots are split into
+        // threads ranges and t is the index of the range. The table must not change meanwhile
+        template<typename Visit>
+        void ForEachParallel(size_t threads, Visit visit);
+
+        // moves the rest of a pending incremental migration, lookups then probe only the current arrays
+        inline void FinishMigration() { MigrateStep(SIZE_MAX); }
+
+        inline iterator begin();
+
+        inline iterator end();
+
+        inline U& GetByIdx(size_t idx) { return impl.array[idx]; }
+
+        inline bool IsFull(size_t idx) { return impl.ctrl[idx] >= 0; }
+
+        // free slots left until an insert has to grow the table or drop the tombstones
+        inline size_t Headroom() { return impl.limit - impl.size - impl.tombstones; }
+
+        inline size_t size() { return impl.size; }
+
+        inline size_t capacity() { return impl.capacity; }
+
+        // bytes allocated for the slots, the control bytes and the stored hashes
+        inline size_t memory_usage() {
+            auto old = Migrating();
+            return MemoryUsage(impl) + (old ? MemoryUsage(*old) : 0);
+        }
+
+        // the counters with the slots of the current arrays counted by their state
+        hash_stats Stats() requires Policy::collect_stats;
+
+    private:
+        using Group = detail::Group;
+
+        static constexpr size_t kBatch = 16;
+
+        static constexpr size_t npos = SIZE_MAX;
+
+        template<typename K>
+        inline size_t FindIndex(const K& key, size_t hash);
+
+        // probes is set to the probe length with Policy::collect_stats
+        template<typename K>
+        static inline size_t FindIndexIn(HashTable_impl& table, const K& key, size_t hash, size_t* probes = nullptr);
+
+        template<typename K>
+        inline size_t FindIndexRobinHood(const K& key, size_t hash);
+
+        // returns the slot where carry itself ends up
+        template<typename KeyByValue>
+        inline size_t PlaceRobinHood(size_t pos, int dist, size_t hash, U carry);
+
+        inline void EraseRobinHood(size_t idx);
+
+        inline size_t Next(size_t pos) { return pos + 1 == impl.capacity ? 0 : pos + 1; }
+
+        template<typename KeyByValue, typename V>
+        inline void InsertImpl(const T& key, V&& value);
+
+        // constructs an element in the free slot idx of impl
+        template<typename... Args>
+        inline size_t PlaceAt(size_t idx, size_t hash, Args&& ... args);
+
+        // places n elements of source into the arrays, the parallel part of MergeParallel and RehashParallel
+        template<typename KeyByValue, typename Source, typename HashBy, typename Merge>
+        void PlaceParallel(size_t n, Source source, HashBy hash_of, Merge merge, size_t threads);
+
+        // moves an element of the old arrays into impl ahead of the incremental migration
+        inline size_t MoveFromOld(HashTable_impl& old_impl, size_t idx, size_t hash);
+
+        static inline void SetCtrl(HashTable_impl& table, size_t idx, int8_t h2);
+
+        static inline size_t NextGroup(const HashTable_impl& table, size_t pos);
+
+        static inline size_t FindFirstNonFull(const HashTable_impl& table, size_t hash);
+
+        // the capacity of the arrays inside the object, below a group it is exactly Policy::inline_capacity
+        static constexpr size_t kInlineSlots =
+                Policy::inline_capacity == 0 ? 0 :
+                Policy::inline_capacity < Group::kWidth ? Policy::inline_capacity :
+                detail::CapacityFor<Policy>(Policy::inline_capacity);
+
+        // a table that fits in the inline arrays takes all of them
+        static inline size_t CapacityFor(size_t size) {
+            if (size <= kInlineSlots && kInlineSlots < Group::kWidth) {
+                return kInlineSlots;
+            }
+            return std::max(detail::CapacityFor<Policy>(size), kInlineSlots);
+        }
+
+        // the capacity of the arrays that hold at least capacity slots
+        static inline size_t ArraysCapacity(size_t capacity) {
+            if (capacity <= kInlineSlots && kInlineSlots < Group::kWidth) {
+                return kInlineSlots;
+            }
+            return Policy::index::Capacity(std::max(capacity, Group::kWidth));
+        }
+
+        // a table narrower than a group is full at its capacity, its first group always ends with empty bytes
+        static inline size_t Limit(size_t capacity) {
+            return capacity < Group::kWidth ? capacity + 1 : detail::Limit<Policy>(capacity);
+        }
+
+        // the first slot of the probe sequence, a table narrower than a group is probed from its start
+        static inline size_t Home(size_t hash, size_t capacity) {
+            return capacity < Group::kWidth ? 0 : Policy::index::Index(hash, capacity);
+        }
+
+        inline size_t GrownCapacity() {
+            return std::max(static_cast<size_t>(static_cast<double>(impl.capacity) * Policy::growth_factor),
+                            impl.capacity + 1);
+        }
+
+        // what has to match between the table that saved a snapshot and the one that maps it
+        static inline uint64_t Layout() {
+            return detail::TypeFingerprint<HashTable>() ^ (Group::kWidth << 32u) ^ sizeof(U);
+        }
+
+        static inline size_t MemoryUsage(const HashTable_impl& table) {
+            return table.capacity * (sizeof(U) + (Policy::store_hash ? sizeof(size_t) : 0)) + table.capacity +
+                   Group::kWidth;
+        }
+
+        // takes the inline arrays if they fit and are free
+        inline void Allocate(HashTable_impl& table);
+
+        inline void Deallocate(HashTable_impl& table);
+
+        // doubles the capacity at once or starts an incremental migration
+        template<typename KeyByValue>
+        inline void Grow();
+
+        template<typename KeyByValue>
+        void Migrate(size_t slots);
+
+        inline void MigrateStep(size_t slots) {
+            if constexpr (Policy::incremental_rehash != 0) {
+                if (migration.migrate) {
+                    (this->*migration.migrate)(slots);
+                }
+            }
+        }
+
+        HashTable_impl impl;
+
+        [[no_unique_address]] detail::InlineArrays<U, kInlineSlots, Policy::store_hash> inline_arrays;
+
+        [[no_unique_address]] std::conditional_t<Policy::collect_stats, hash_stats, detail::NoStats> counters;
+
+        // the arrays that are being migrated into impl, valid while migrate != nullptr
+        struct Migration {
+            explicit Migration(const HashTable_impl& impl) : old_impl(impl) {}
+
+            HashTable_impl old_impl;
+            size_t migrated = 0;
+            void (HashTable::*migrate)(size_t) = nullptr;
+        };
+
+        struct NoMigration {
+            explicit NoMigration(const HashTable_impl&) {}
+        };
+
+        [[no_unique_address]] std::conditional_t<Policy::incremental_rehash != 0, Migration, NoMigration> migration;
+
+        // the old arrays of a pending incremental migration or nullptr
+        inline HashTable_impl* Migrating() {
+            if constexpr (Policy::incremental_rehash != 0) {
+                return migration.migrate ? &migration.old_impl : nullptr;
+            } else {
+                return nullptr;
+            }
+        }
+    };
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator::iterator(size_t idx, HashTable_impl& hashTable):idx(idx),
+                                                                                                     hashTable(
+                                                                                                             &hashTable) {
+
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    typename HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator&
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator::operator++() {
+        ++idx;
+        while (idx < hashTable->capacity && hashTable->ctrl[idx] < 0) {
+            ++idx;
+        }
+        return *this;
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    typename HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator&
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator::operator--() {
+        --idx;
+        while (idx <= hashTable->capacity && hashTable->ctrl[idx] < 0) {
+            --idx;
+        }
+        return *this;
+    }
+
+#define _array impl.array
+#define _size impl.size
+#define _capacity impl.capacity
+#define _tombstones impl.tombstones
+#define _ctrl impl.ctrl
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::HashTable(size_t size, Alloc alloc, Hash hash):
+            impl(alloc, hash), migration(impl) {
+        static_assert(std::is_same_v<typename Alloc::value_type, U>);
+        _size = 0;
+        _tombstones = 0;
+        _capacity = CapacityFor(size);
+        Allocate(impl);
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::~HashTable() {
+        Deallocate(impl);
+        if (auto old = Migrating()) {
+            Deallocate(*old);
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Allocate(HashTable_impl& table) {
+        // slots stay uninitialized until an element is inserted into them
+        table.mapping = nullptr;
+        table.limit = Limit(table.capacity);
+        table.hashes = nullptr;
+        bool in_object = false;
+        if constexpr (kInlineSlots != 0) {
+            // the other arrays of a rehash may hold them
+            if (!inline_arrays.used && table.capacity <= kInlineSlots) {
+                in_object = inline_arrays.used = true;
+                table.array = reinterpret_cast<U*>(inline_arrays.array);
+                table.ctrl = inline_arrays.ctrl;
+                if constexpr (Policy::store_hash) {
+                    table.hashes = inline_arrays.hashes;
+                }
+            }
+        }
+        if (!in_object) {
+            table.array = table.allocate(table.capacity);
+            typename std::allocator_traits<Alloc>::template rebind_alloc<int8_t> _rebind(table);
+            table.ctrl = _rebind.allocate(table.capacity + Group::kWidth);
+            if constexpr (Policy::store_hash) {
+                typename std::allocator_traits<Alloc>::template rebind_alloc<size_t> _rebind_hashes(table);
+                table.hashes = _rebind_hashes.allocate(table.capacity);
+            }
+        }
+        std::fill(table.ctrl, table.ctrl + table.capacity + Group::kWidth, detail::kEmpty);
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Deallocate(HashTable_impl& table) {
+        if (table.mapping) {
+            // the elements are trivially destructible
+            detail::UnmapFile(table.mapping, table.mapping_size);
+            table.mapping = nullptr;
+            return;
+        }
+        for (size_t i = 0; i < table.capacity; ++i) {
+            if (table.ctrl[i] >= 0) {
+                std::allocator_traits<Alloc>::destroy(table, table.array + i);
+            }
+        }
+        if constexpr (kInlineSlots != 0) {
+            if (table.ctrl == inline_arrays.ctrl) {
+                inline_arrays.used = false;
+                return;
+            }
+        }
+        table.deallocate(table.array, table.capacity);
+        typename std::allocator_traits<Alloc>::template rebind_alloc<int8_t> _rebind(table);
+        _rebind.deallocate(table.ctrl, table.capacity + Group::kWidth);
+        if constexpr (Policy::store_hash) {
+            typename std::allocator_traits<Alloc>::template rebind_alloc<size_t> _rebind_hashes(table);
+            _rebind_hashes.deallocate(table.hashes, table.capacity);
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::SetCtrl(HashTable_impl& table, size_t idx, int8_t h2) {
+        table.ctrl[idx] = h2;
+        if (idx < Group::kWidth && table.capacity >= Group::kWidth) {
+            table.ctrl[table.capacity + idx] = h2;
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::NextGroup(const HashTable_impl& table, size_t pos) {
+        pos += Group::kWidth;
+        if (pos >= table.capacity) {
+            pos -= table.capacity;
+        }
+        return pos;
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::FindFirstNonFull(const HashTable_impl& table, size_t hash) {
+        auto pos = Home(hash, table.capacity);
+        while (true) {
+            if (auto free = Group(table.ctrl + pos).MatchEmptyOrDeleted()) {
+                pos += free.LowestBitSet();
+                if (pos >= table.capacity) {
+                    pos -= table.capacity;
+                }
+                return pos;
+            }
+            pos = NextGroup(table, pos);
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::FindIndex(const K& key, size_t hash) {
+        if constexpr (Policy::robin_hood) {
+            return FindIndexRobinHood(key, hash);
+        } else if constexpr (Policy::collect_stats) {
+            size_t probes;
+            auto idx = FindIndexIn(impl, key, hash, &probes);
+            counters.Probed(probes, idx != npos);
+            return idx;
+        }
+        return FindIndexIn(impl, key, hash);
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::FindIndexIn(HashTable_impl& table, const K& key, size_t hash,
+                                                                      [[maybe_unused]] size_t* probes) {
+        auto h2 = detail::H2(hash);
+        auto pos = Home(hash, table.capacity);
+        [[maybe_unused]] size_t uncounted;
+        if constexpr (Policy::collect_stats) {
+            // the lookups in the old arrays of a migration pass no counter
+            if (!probes) {
+                probes = &uncounted;
+            }
+            *probes = 0;
+        }
+        while (true) {
+            if constexpr (Policy::collect_stats) {
+                ++*probes;
+            }
+            Group group(table.ctrl + pos);
+            for (uint32_t i: group.Match(h2)) {
+                auto idx = pos + i;
+                if (idx >= table.capacity) {
+                    idx -= table.capacity;
+                }
+                if constexpr (Policy::store_hash) {
+                    if (table.hashes[idx] != hash) {
+                        continue;
+                    }
+                }
+                if (table.compare(table.array[idx], key)) {
+                    return idx;
+                }
+            }
+            if (group.MatchEmpty()) {
+                return npos;
+            }
+            pos = NextGroup(table, pos);
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::FindIndexRobinHood(const K& key, size_t hash) {
+        auto pos = Home(hash, _capacity);
+        // elements are ordered by the distance from their home slot, only those with the same distance
+        // share the home slot with the key
+        int dist = 0;
+        for (; _ctrl[pos] >= dist; ++dist, pos = Next(pos)) {
+            if (_ctrl[pos] != dist) {
+                continue;
+            }
+            if constexpr (Policy::store_hash) {
+                if (impl.hashes[pos] != hash) {
+                    continue;
+                }
+            }
+            if (impl.compare(_array[pos], key)) {
+                counters.Probed(dist + 1, true);
+                return pos;
+            }
+        }
+        counters.Probed(dist + 1, false);
+        return npos;
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::PlaceRobinHood(size_t pos, int dist, size_t hash, U carry) {
+        auto placed = npos;
+        while (true) {
+            auto current = _ctrl[pos];
+            if (current < 0) {
+                std::allocator_traits<Alloc>::construct(impl, _array + pos, std::move(carry));
+                SetCtrl(impl, pos, static_cast<int8_t>(dist));
+                if constexpr (Policy::store_hash) {
+                    impl.hashes[pos] = hash;
+                }
+                return placed == npos ? pos : placed;
+            }
+            if (current < dist) {
+                if (placed == npos) {
+                    placed = pos;
+                }
+                std::swap(_array[pos], carry);
+                SetCtrl(impl, pos, static_cast<int8_t>(dist));
+                if constexpr (Policy::store_hash) {
+                    std::swap(impl.hashes[pos], hash);
+                }
+                dist = current;
+            }
+            if (dist == detail::kMaxDistance) {
+                // the carried element can't move any further, it is placed again into a bigger table
+                if constexpr (!Policy::store_hash) {
+                    hash = impl(KeyByValue()(carry));
+                }
+                if (placed == npos) {
+                    Rehash(GrownCapacity(), KeyByValue());
+                    return PlaceRobinHood<KeyByValue>(Home(hash, _capacity), 0, hash, std::move(carry));
+                }
+                // the new element moves with the rehash, it is found again by a copy of its key (a rare path)
+                T key = KeyByValue()(_array[placed]);
+                size_t placed_hash;
+                if constexpr (Policy::store_hash) {
+                    placed_hash = impl.hashes[placed];
+                } else {
+                    placed_hash = impl(key);
+                }
+                Rehash(GrownCapacity(), KeyByValue());
+                PlaceRobinHood<KeyByValue>(Home(hash, _capacity), 0, hash, std::move(carry));
+                return FindIndex(key, placed_hash);
+            }
+            ++dist;
+            pos = Next(pos);
+        }
+    }
 
-        U& Find(const T& key);
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::EraseRobinHood(size_t idx) {
+        // backward shift: the following elements that are not in their home slots move one slot closer to it
+        for (auto next = Next(idx); _ctrl[next] > 0; idx = next, next = Next(next)) {
+            _array[idx] = std::move(_array[next]);
+            SetCtrl(impl, idx, static_cast<int8_t>(_ctrl[next] - 1));
+            if constexpr (Policy::store_hash) {
+                impl.hashes[idx] = impl.hashes[next];
+            }
+        }
+        std::allocator_traits<Alloc>::destroy(impl, _array + idx);
+        SetCtrl(impl, idx, detail::kEmpty);
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue, typename V>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::InsertImpl(const T& key, V&& value) {
+        auto [it, inserted] = TryEmplace<KeyByValue>(key, std::forward<V>(value));
+        if (!inserted) {
+            *it = std::forward<V>(value);
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue, typename K, typename... Args>
+    std::pair<typename HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator, bool>
+    HashTable<T, U, Compare, Alloc, Hash, Policy>::TryEmplaceHashed(size_t hash, const K& key, Args&& ... args) {
+        if constexpr (Policy::robin_hood) {
+            auto pos = Home(hash, _capacity);
+            int dist = 0;
+            for (; _ctrl[pos] >= dist; ++dist, pos = Next(pos)) {
+                if (_ctrl[pos] != dist) {
+                    continue;
+                }
+                if constexpr (Policy::store_hash) {
+                    if (impl.hashes[pos] != hash) {
+                        continue;
+                    }
+                }
+                if (impl.compare(_array[pos], key)) {
+                    counters.Probed(dist + 1, true);
+                    return {iterator(pos, impl), false};
+                }
+            }
+            counters.Probed(dist + 1, false);
+            if (dist > detail::kMaxDistance) {
+                Rehash(GrownCapacity(), KeyByValue());
+                return TryEmplaceHashed<KeyByValue>(hash, key, std::forward<Args>(args)...);
+            }
+            // the element is built before the arrays change, so args may refer to the elements of the table
+            U carry(std::forward<Args>(args)...);
+            ++_size;
+            if (_size >= impl.limit) {
+                Rehash(GrownCapacity(), KeyByValue());
+                pos = Home(hash, _capacity);
+                dist = 0;
+            }
+            return {iterator(PlaceRobinHood<KeyByValue>(pos, dist, hash, std::move(carry)), impl), true};
+        }
+        MigrateStep(Policy::incremental_rehash);
+        auto h2 = detail::H2(hash);
+        auto pos = Home(hash, _capacity);
+        auto idx = npos;
+        [[maybe_unused]] size_t probes = 0;
+        while (true) {
+            if constexpr (Policy::collect_stats) {
+                ++probes;
+            }
+            Group group(_ctrl + pos);
+            for (uint32_t i: group.Match(h2)) {
+                auto j = pos + i;
+                if (j >= _capacity) {
+                    j -= _capacity;
+                }
+                if constexpr (Policy::store_hash) {
+                    if (impl.hashes[j] != hash) {
+                        continue;
+                    }
+                }
+                if (impl.compare(_array[j], key)) {
+                    counters.Probed(probes, true);
+                    return {iterator(j, impl), false};
+                }
+            }
+            if (idx == npos) {
+                if (auto free = group.MatchEmptyOrDeleted()) {
+                    idx = pos + free.LowestBitSet();
+                    if (idx >= _capacity) {
+                        idx -= _capacity;
+                    }
+                }
+            }
+            if (group.MatchEmpty()) {
+                break;
+            }
+            pos = NextGroup(impl, pos);
+        }
+        counters.Probed(probes, false);
+        if (auto old = Migrating()) {
+            if (auto j = FindIndexIn(*old, key, hash); j != npos) {
+                return {iterator(MoveFromOld(*old, j, hash), impl), false};
+            }
+        }
+        auto tombstones = _tombstones - (_ctrl[idx] == detail::kDeleted);
+        if (_size + 1 + tombstones < impl.limit) {
+            return {iterator(PlaceAt(idx, hash, std::forward<Args>(args)...), impl), true};
+        }
+        // the element is built before the arrays change, so args may refer to the elements of the table
+        U value(std::forward<Args>(args)...);
+        if (_size + 1 >= impl.limit >> 1u) {
+            Grow<KeyByValue>();
+        } else {
+            // a table clogged with tombstones is cleaned up without growing
+            DropTombstones(KeyByValue());
+        }
+        return {iterator(PlaceAt(FindFirstNonFull(impl, hash), hash, std::move(value)), impl), true};
+    }
 
-        inline iterator begin();
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename... Args>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::PlaceAt(size_t idx, size_t hash, Args&& ... args) {
+        if (_ctrl[idx] == detail::kDeleted) {
+            --_tombstones;
+        }
+        std::allocator_traits<Alloc>::construct(impl, _array + idx, std::forward<Args>(args)...);
+        SetCtrl(impl, idx, detail::H2(hash));
+        if constexpr (Policy::store_hash) {
+            impl.hashes[idx] = hash;
+        }
+        ++_size;
+        return idx;
+    }
 
-        inline iterator end();
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Insert(const T& key, const U& value) {
+        InsertImpl<KeyByValue>(key, value);
+    }
 
-        inline U& GetByIdx(size_t idx) { return impl.array[idx]; }
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    bool HashTable<T, U, Compare, Alloc, Hash, Policy>::Delete(const K& key, size_t hash) {
+        MigrateStep(Policy::incremental_rehash);
+        auto idx = FindIndex(key, hash);
+        if (idx == npos) {
+            if (auto old = Migrating()) {
+                if (auto j = FindIndexIn(*old, key, hash); j != npos) {
+                    std::allocator_traits<Alloc>::destroy(*old, old->array + j);
+                    SetCtrl(*old, j, detail::kDeleted);
+                    --_size;
+                    return true;
+                }
+            }
+            return false;
+        }
+        --_size;
+        if constexpr (Policy::robin_hood) {
+            EraseRobinHood(idx);
+            return true;
+        }
+        std::allocator_traits<Alloc>::destroy(impl, _array + idx);
+        // the slot may become empty again if no probe sequence has ever passed through it,
+        // that is if it does not belong to a window of Group::kWidth consecutive used slots
+        if (_capacity < Group::kWidth) {
+            SetCtrl(impl, idx, detail::kEmpty);
+            return true;
+        }
+        auto before = idx >= Group::kWidth ? idx - Group::kWidth : idx + _capacity - Group::kWidth;
+        auto empty_before = Group(_ctrl + before).MatchEmpty();
+        auto empty_after = Group(_ctrl + idx).MatchEmpty();
+        if (empty_before.LeadingZeros() + empty_after.TrailingZeros() < Group::kWidth) {
+            SetCtrl(impl, idx, detail::kEmpty);
+        } else {
+            SetCtrl(impl, idx, detail::kDeleted);
+            ++_tombstones;
+        }
+        return true;
+    }
 
-        inline size_t size() { return impl.size; }
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Rehash(size_t new_size, KeyByValue keyByValue) {
+        detail::StatsTimer timer(counters, true);
+        MigrateStep(SIZE_MAX);
+        if constexpr (Policy::robin_hood) {
+            // elements are placed into the new arrays through the usual displacement
+            HashTable_impl old_impl(impl);
+            _capacity = ArraysCapacity(new_size);
+            Allocate(impl);
+            for (size_t i = 0; i < old_impl.capacity; ++i) {
+                if (old_impl.ctrl[i] < 0) {
+                    continue;
+                }
+                size_t hash;
+                if constexpr (Policy::store_hash) {
+                    hash = old_impl.hashes[i];
+                } else {
+                    hash = impl(keyByValue(old_impl.array[i]));
+                }
+                PlaceRobinHood<KeyByValue>(Home(hash, _capacity), 0, hash, std::move(old_impl.array[i]));
+            }
+            Deallocate(old_impl);
+            return;
+        }
+        HashTable_impl new_impl(impl);
+        new_impl.capacity = ArraysCapacity(new_size);
+        new_impl.size = _size;
+        new_impl.tombstones = 0;
+        Allocate(new_impl);
 
-        inline size_t capacity() { return impl.capacity; }
+        for (size_t i = 0; i < _capacity; ++i) {
+            if (_ctrl[i] < 0) {
+                continue;
+            }
+            auto& j = _array[i];
+            //Insert
+            size_t hash;
+            if constexpr (Policy::store_hash) {
+                hash = impl.hashes[i];
+            } else {
+                hash = impl(keyByValue(j));
+            }
+            auto pos = FindFirstNonFull(new_impl, hash);
+            std::allocator_traits<Alloc>::construct(new_impl, new_impl.array + pos, std::move(j));
+            SetCtrl(new_impl, pos, detail::H2(hash));
+            if constexpr (Policy::store_hash) {
+                new_impl.hashes[pos] = hash;
+            }
+        }
+        Deallocate(impl);
+        impl = new_impl;
+    }
 
-    private:
-        HashTable_impl impl;
-    };
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Reserve(size_t size, size_t threads) {
+        auto capacity = CapacityFor(size);
+        if (capacity > _capacity) {
+            if (threads > 1) {
+                RehashParallel<KeyByValue>(capacity, threads);
+            } else {
+                Rehash(capacity, KeyByValue());
+            }
+        }
+    }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    HashTable<T, U, Compare, Alloc, Hash>::iterator::iterator(size_t idx, HashTable_impl& hashTable):idx(idx),
-                                                                                                     hashTable(
-                                                                                                             &hashTable) {
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    hash_stats HashTable<T, U, Compare, Alloc, Hash, Policy>::Stats() requires Policy::collect_stats {
+        auto stats = counters;
+        stats.occupied = stats.tombstones = stats.empty = 0;
+        for (size_t i = 0; i < _capacity; ++i) {
+            ++(_ctrl[i] >= 0 ? stats.occupied : _ctrl[i] == detail::kDeleted ? stats.tombstones : stats.empty);
+        }
+        return stats;
+    }
 
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    bool HashTable<T, U, Compare, Alloc, Hash, Policy>::Save(const char* path) {
+        static_assert(detail::kTriviallyCopyable<U>, "only the tables of trivially copyable elements can be saved");
+        MigrateStep(SIZE_MAX);
+        auto file = std::fopen(path, "wb");
+        if (!file) {
+            return false;
+        }
+        detail::SnapshotHeader header{};
+        std::memcpy(header.magic, detail::SnapshotHeader::kMagic, sizeof(header.magic));
+        header.version = detail::SnapshotHeader::kVersion;
+        header.layout = Layout();
+        header.capacity = _capacity;
+        header.size = _size;
+        header.tombstones = _tombstones;
+        if constexpr (detail::seeded<Hash>) {
+            header.seed = static_cast<const Hash&>(impl).seed();
+        }
+        // the free slots are written as zeros, the buffer holds a chunk of the slots at a time
+        constexpr size_t kChunk = 4096;
+        std::vector<char> buffer(std::max(detail::kSnapshotAlign, kChunk * sizeof(U)));
+        size_t offset = 0;
+        auto write = [&](const void* data, size_t size) {
+            offset += size;
+            return std::fwrite(data, 1, size, file) == size;
+        };
+        auto pad = [&]() {
+            return write(buffer.data(), detail::AlignSnapshot(offset) - offset);
+        };
+        std::fill(buffer.begin(), buffer.end(), 0);
+        auto ok = write(&header, sizeof(header)) && pad() && write(_ctrl, _capacity + Group::kWidth) && pad();
+        for (size_t begin = 0; ok && begin < _capacity; begin += kChunk) {
+            auto end = std::min(_capacity, begin + kChunk);
+            std::fill(buffer.begin(), buffer.end(), 0);
+            for (auto i = begin; i < end; ++i) {
+                if (_ctrl[i] >= 0) {
+                    std::memcpy(buffer.data() + (i - begin) * sizeof(U), _array + i, sizeof(U));
+                }
+            }
+            ok = write(buffer.data(), (end - begin) * sizeof(U));
+        }
+        if constexpr (Policy::store_hash) {
+            std::fill(buffer.begin(), buffer.end(), 0);
+            ok = ok && pad() && write(impl.hashes, _capacity * sizeof(size_t));
+        }
+        return std::fclose(file) == 0 && ok;
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    typename HashTable<T, U, Compare, Alloc, Hash>::iterator&
-    HashTable<T, U, Compare, Alloc, Hash>::iterator::operator++() {
-        ++idx;
-        while (idx < hashTable->capacity && hashTable->deleted[idx] != 0) {
-            ++idx;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    bool HashTable<T, U, Compare, Alloc, Hash, Policy>::MapFromFile(const char* path) {
+        static_assert(detail::kTriviallyCopyable<U>, "only the tables of trivially copyable elements can be mapped");
+        size_t size = 0;
+        auto mapping = static_cast<char*>(detail::MapFile(path, size));
+        if (!mapping) {
+            return false;
         }
-        return *this;
+        detail::SnapshotHeader header{};
+        if (size >= sizeof(header)) {
+            std::memcpy(&header, mapping, sizeof(header));
+        }
+        auto ctrl_offset = detail::AlignSnapshot(sizeof(header));
+        auto array_offset = detail::AlignSnapshot(ctrl_offset + header.capacity + Group::kWidth);
+        auto hashes_offset = detail::AlignSnapshot(array_offset + header.capacity * sizeof(U));
+        auto expected = Policy::store_hash ? hashes_offset + header.capacity * sizeof(size_t) :
+                        array_offset + header.capacity * sizeof(U);
+        if (std::memcmp(header.magic, detail::SnapshotHeader::kMagic, sizeof(header.magic)) != 0 ||
+            header.version != detail::SnapshotHeader::kVersion || header.layout != Layout() ||
+            ArraysCapacity(header.capacity) != header.capacity || size != expected) {
+            detail::UnmapFile(mapping, size);
+            return false;
+        }
+        MigrateStep(SIZE_MAX);
+        Deallocate(impl);
+        impl.mapping = mapping;
+        impl.mapping_size = size;
+        _capacity = header.capacity;
+        _size = header.size;
+        _tombstones = header.tombstones;
+        if constexpr (detail::seeded<Hash>) {
+            SetHash(Hash(header.seed));
+        }
+        impl.limit = Limit(_capacity);
+        _ctrl = reinterpret_cast<int8_t*>(mapping + ctrl_offset);
+        _array = reinterpret_cast<U*>(mapping + array_offset);
+        impl.hashes = Policy::store_hash ? reinterpret_cast<size_t*>(mapping + hashes_offset) : nullptr;
+        return true;
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    typename HashTable<T, U, Compare, Alloc, Hash>::iterator&
-    HashTable<T, U, Compare, Alloc, Hash>::iterator::operator--() {
-        --idx;
-        while (idx <= hashTable->capacity && hashTable->deleted[idx] != 0) {
-            --idx;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::RehashParallel(size_t new_size, size_t threads) {
+        if constexpr (Policy::robin_hood) {
+            // the displacement chains cross any split of the table
+            Rehash(new_size, KeyByValue());
+        } else {
+            detail::StatsTimer timer(counters, true);
+            MigrateStep(SIZE_MAX);
+            HashTable_impl old_impl(impl);
+            _capacity = ArraysCapacity(new_size);
+            _size = 0;
+            _tombstones = 0;
+            Allocate(impl);
+            PlaceParallel<KeyByValue>(old_impl.capacity, [&old_impl](size_t i) {
+                return old_impl.ctrl[i] >= 0 ? old_impl.array + i : nullptr;
+            }, [this, &old_impl](size_t i) {
+                if constexpr (Policy::store_hash) {
+                    return old_impl.hashes[i];
+                } else {
+                    return impl(KeyByValue()(old_impl.array[i]));
+                }
+            }, [](U& present, U&& element) { present = std::move(element); }, threads);
+            Deallocate(old_impl);
         }
-        return *this;
     }
 
-#define _array impl.array
-#define _size impl.size
-#define _capacity impl.capacity
-#define _deleted impl.deleted
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue, typename Source>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::InsertParallel(size_t n, Source source, size_t threads) {
+        MergeParallel<KeyByValue>(n, source, [this, &source](size_t i) {
+            return impl(KeyByValue()(*source(i)));
+        }, [](U& present, auto&& element) { present = std::forward<decltype(element)>(element); }, threads);
+    }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    HashTable<T, U, Compare, Alloc, Hash>::HashTable(size_t size, Alloc alloc):impl(alloc) {
-        static_assert(std::is_same_v<typename Alloc::value_type, U>);
-        _size = 0;
-        _capacity = size * 2;
-        _array = impl.allocate(_capacity);
-        for (int i = 0; i < _capacity; ++i) {
-            std::allocator_traits<Alloc>::construct(impl, _array + i);
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue, typename Source, typename HashBy, typename Merge>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::MergeParallel(size_t n, Source source, HashBy hash_of,
+                                                                      Merge merge, size_t threads) {
+        MigrateStep(SIZE_MAX);
+        if constexpr (Policy::robin_hood) {
+            Reserve<KeyByValue>(_size + n);
+            for (size_t i = 0; i < n; ++i) {
+                if (auto element = source(i)) {
+                    auto [it, inserted] = TryEmplaceHashed<KeyByValue>(hash_of(i), KeyByValue()(*element), *element);
+                    if (!inserted) {
+                        merge(*it, *element);
+                    }
+                }
+            }
+        } else {
+            // the regions are filled only with empty slots in mind, so the tombstones go away together with the grow
+            auto capacity = CapacityFor(_size + n);
+            if (capacity > _capacity || _tombstones != 0) {
+                RehashParallel<KeyByValue>(std::max(capacity, _capacity), threads);
+            }
+            PlaceParallel<KeyByValue>(n, source, hash_of, merge, threads);
         }
-        typename std::allocator_traits<Alloc>::template rebind_alloc<int8_t> _rebind(impl);
-        _deleted = _rebind.allocate(_capacity);
-        std::fill(_deleted, _deleted + _capacity, -1);
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    HashTable<T, U, Compare, Alloc, Hash>::~HashTable() {
-        for (int i = 0; i < _capacity; ++i) {
-            std::allocator_traits<Alloc>::destroy(impl, _array + i);
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue, typename Source, typename HashBy, typename Merge>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::PlaceParallel(size_t n, Source source, HashBy hash_of,
+                                                                      Merge merge, size_t threads) {
+        // regions of the table, [RegionBegin(r), RegionBegin(r + 1)) holds the home slots of region r
+        auto regions = std::max<size_t>(1, std::min(threads, _capacity / Group::kWidth));
+        auto region_of = [this, regions](size_t hash) {
+            return Home(hash, _capacity) * regions / _capacity;
+        };
+        auto region_begin = [this, regions](size_t r) { return (r * _capacity + regions - 1) / regions; };
+        auto chunk_begin = [n, regions](size_t t) { return n * t / regions; };
+
+        // the elements are hashed and counted per (chunk, region), then sorted by region keeping their order
+        std::vector<size_t> hashes(n);
+        std::vector<size_t> offsets(regions * regions);
+        detail::ParallelFor(regions, [&](size_t t) {
+            std::vector<size_t> counts(regions);
+            for (auto i = chunk_begin(t); i < chunk_begin(t + 1); ++i) {
+                if (source(i)) {
+                    hashes[i] = hash_of(i);
+                    ++counts[region_of(hashes[i])];
+                }
+            }
+            std::copy(counts.begin(), counts.end(), offsets.begin() + t * regions);
+        });
+        std::vector<size_t> bounds(regions + 1);
+        size_t total = 0;
+        for (size_t r = 0; r < regions; ++r) {
+            bounds[r] = total;
+            for (size_t t = 0; t < regions; ++t) {
+                auto count = offsets[t * regions + r];
+                offsets[t * regions + r] = total;
+                total += count;
+            }
         }
-        impl.deallocate(_array, _capacity);
-        typename std::allocator_traits<Alloc>::template rebind_alloc<int8_t> _rebind(impl);
-        _rebind.deallocate(_deleted, _capacity);
-    }
+        bounds[regions] = total;
+        std::vector<size_t> order(total);
+        detail::ParallelFor(regions, [&](size_t t) {
+            for (auto i = chunk_begin(t); i < chunk_begin(t + 1); ++i) {
+                if (source(i)) {
+                    order[offsets[t * regions + region_of(hashes[i])]++] = i;
+                }
+            }
+        });
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    template<typename KeyByValue>
-    void HashTable<T, U, Compare, Alloc, Hash>::Insert(const T& key, const U& value) {
-        auto hash = impl(key) % _capacity;
-        int32_t idx = -1;
-        while (_deleted[hash] != -1 && !impl.compare(_array[hash], key)) {
-            ++hash;
-            if (hash >= _capacity) {
-                hash -= _capacity;
+        // a region is filled by one thread that never touches the slots of the others, the elements whose probe
+        // sequence reaches a group that leaves the region are left for the calling thread. The groups are probed
+        // like TryEmplaceHashed does: Delete may leave an empty slot before a present key of the same group
+        auto forward = [](auto& element) -> decltype(auto) {
+            if constexpr (std::is_const_v<std::remove_reference_t<decltype(element)>>) {
+                return element;
+            } else {
+                return std::move(element);
+            }
+        };
+        std::vector<std::vector<size_t>> deferred(regions);
+        std::vector<size_t> placed(regions);
+        detail::ParallelFor(regions, [&](size_t r) {
+            auto end = region_begin(r + 1);
+            for (auto k = bounds[r]; k < bounds[r + 1]; ++k) {
+                auto i = order[k];
+                auto hash = hashes[i];
+                auto& element = *source(i);
+                auto h2 = detail::H2(hash);
+                for (auto pos = Home(hash, _capacity);; pos += Group::kWidth) {
+                    if (pos + Group::kWidth > end) {
+                        deferred[r].push_back(i);
+                        break;
+                    }
+                    Group group(_ctrl + pos);
+                    auto present = npos;
+                    for (uint32_t j: group.Match(h2)) {
+                        if (impl.compare(_array[pos + j], KeyByValue()(element))) {
+                            present = pos + j;
+                            break;
+                        }
+                    }
+                    if (present != npos) {
+                        merge(_array[present], forward(element));
+                        break;
+                    }
+                    // there are no tombstones, the first empty slot of the probe sequence is the one to take
+                    if (auto empty = group.MatchEmpty()) {
+                        auto idx = pos + empty.LowestBitSet();
+                        std::allocator_traits<Alloc>::construct(impl, _array + idx, forward(element));
+                        SetCtrl(impl, idx, h2);
+                        if constexpr (Policy::store_hash) {
+                            impl.hashes[idx] = hash;
+                        }
+                        ++placed[r];
+                        break;
+                    }
+                }
             }
-            if (_deleted[hash] && idx == -1) {
-                idx = hash;
+        });
+        for (size_t r = 0; r < regions; ++r) {
+            _size += placed[r];
+        }
+        for (auto& region: deferred) {
+            for (auto i: region) {
+                auto& element = *source(i);
+                auto [it, inserted] = TryEmplaceHashed<KeyByValue>(hashes[i], KeyByValue()(element), forward(element));
+                if (!inserted) {
+                    merge(*it, forward(element));
+                }
             }
         }
-        if (_deleted[hash] != -1) {
-            _array[hash] = value;
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::ShrinkToFit() {
+        auto capacity = CapacityFor(_size);
+        if (capacity < _capacity) {
+            Rehash(capacity, KeyByValue());
+        } else if (_tombstones) {
+            DropTombstones(KeyByValue());
+        }
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::DropTombstones(KeyByValue keyByValue) {
+        if constexpr (Policy::robin_hood) {
             return;
         }
-        if (idx < 0) {
-            idx = hash;
+        detail::StatsTimer timer(counters, false);
+        // tombstones become empty and the elements become kDeleted, that is not placed yet
+        for (size_t i = 0; i < _capacity; ++i) {
+            _ctrl[i] = _ctrl[i] < 0 ? detail::kEmpty : detail::kDeleted;
         }
-        _array[idx] = value;
-        _deleted[idx] = 0;
-        ++_size;
-        if (_size >= _capacity >> 1u) {
-            Rehash(_capacity << 1u, KeyByValue());
+        if (_capacity >= Group::kWidth) {
+            std::copy(_ctrl, _ctrl + Group::kWidth, _ctrl + _capacity);
+        }
+        for (size_t i = 0; i < _capacity; ++i) {
+            if (_ctrl[i] != detail::kDeleted) {
+                continue;
+            }
+            size_t hash;
+            if constexpr (Policy::store_hash) {
+                hash = impl.hashes[i];
+            } else {
+                hash = impl(keyByValue(_array[i]));
+            }
+            auto home = Home(hash, _capacity);
+            auto target = FindFirstNonFull(impl, hash);
+            auto probe_group = [&](size_t idx) {
+                return (idx >= home ? idx - home : idx + _capacity - home) / Group::kWidth;
+            };
+            // the element already is in the first group of its probe sequence that has a free slot
+            if (probe_group(i) == probe_group(target)) {
+                SetCtrl(impl, i, detail::H2(hash));
+                continue;
+            }
+            if (_ctrl[target] == detail::kEmpty) {
+                std::allocator_traits<Alloc>::construct(impl, _array + target, std::move(_array[i]));
+                std::allocator_traits<Alloc>::destroy(impl, _array + i);
+                if constexpr (Policy::store_hash) {
+                    impl.hashes[target] = hash;
+                }
+                SetCtrl(impl, target, detail::H2(hash));
+                SetCtrl(impl, i, detail::kEmpty);
+            } else {
+                // the target holds an element that is not placed yet, it is swapped in and processed next
+                std::swap(_array[i], _array[target]);
+                if constexpr (Policy::store_hash) {
+                    std::swap(impl.hashes[i], impl.hashes[target]);
+                }
+                SetCtrl(impl, target, detail::H2(hash));
+                --i;
+            }
+        }
+        _tombstones = 0;
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Grow() {
+        if constexpr (Policy::incremental_rehash == 0) {
+            Rehash(GrownCapacity(), KeyByValue());
+        } else {
+            // only the allocation is timed, the migration is spread over the following operations
+            detail::StatsTimer timer(counters, true);
+            MigrateStep(SIZE_MAX);
+            migration.old_impl = impl;
+            _capacity = ArraysCapacity(GrownCapacity());
+            _tombstones = 0;
+            Allocate(impl);
+            migration.migrated = 0;
+            migration.migrate = &HashTable::template Migrate<KeyByValue>;
         }
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    void HashTable<T, U, Compare, Alloc, Hash>::Delete(const T& key) {
-        auto hash = impl(key) % _capacity;
-        while (_deleted[hash] != -1 && !impl.compare(_array[hash], key)) {
-            ++hash;
-            if (hash >= _capacity) {
-                hash -= _capacity;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename KeyByValue>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Migrate(size_t slots) {
+        auto& [old_impl, migrated, migrate] = migration;
+        auto last = slots < old_impl.capacity - migrated ? migrated + slots : old_impl.capacity;
+        for (; migrated < last; ++migrated) {
+            if (old_impl.ctrl[migrated] < 0) {
+                continue;
+            }
+            if constexpr (Policy::store_hash) {
+                MoveFromOld(old_impl, migrated, old_impl.hashes[migrated]);
+            } else {
+                MoveFromOld(old_impl, migrated, impl(KeyByValue()(old_impl.array[migrated])));
             }
         }
-        if (!_deleted[hash]) {
-            _deleted[hash] = 1;
-            --_size;
+        if (migrated == old_impl.capacity) {
+            Deallocate(old_impl);
+            migrate = nullptr;
         }
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    template<typename KeyByValue>
-    void HashTable<T, U, Compare, Alloc, Hash>::Rehash(size_t new_size, KeyByValue keyByValue) {
-        typename std::allocator_traits<Alloc>::template rebind_alloc<int8_t> _rebind;
-        HashTable_impl new_impl(impl);
-        new_impl.array = new_impl.allocate(new_size);
-        new_impl.size = _size;
-        new_impl.capacity = new_size;
-        new_impl.deleted = _rebind.allocate(new_size);
-        std::fill(new_impl.deleted, new_impl.deleted + new_size, -1);
-        for (int i = 0; i < new_impl.capacity; ++i) {
-            std::allocator_traits<Alloc>::construct(new_impl, new_impl.array + i);
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    size_t HashTable<T, U, Compare, Alloc, Hash, Policy>::MoveFromOld(HashTable_impl& old_impl, size_t idx,
+                                                                      size_t hash) {
+        auto pos = FindFirstNonFull(impl, hash);
+        if (_ctrl[pos] == detail::kDeleted) {
+            --_tombstones;
         }
+        std::allocator_traits<Alloc>::construct(impl, _array + pos, std::move(old_impl.array[idx]));
+        SetCtrl(impl, pos, detail::H2(hash));
+        if constexpr (Policy::store_hash) {
+            impl.hashes[pos] = hash;
+        }
+        // the slot becomes a tombstone so the probe sequences in the old arrays stay intact
+        std::allocator_traits<Alloc>::destroy(old_impl, old_impl.array + idx);
+        SetCtrl(old_impl, idx, detail::kDeleted);
+        return pos;
+    }
 
-        for (auto i = begin(); i < end(); ++i) {
-            auto& j = *i;
-            //Insert
-            auto hash = impl(keyByValue(j)) % new_impl.capacity;
-            while (new_impl.deleted[hash] != -1) {
-                ++hash;
-                if (hash >= new_impl.capacity) {
-                    hash -= new_impl.capacity;
-                }
-            }
-            new_impl.array[hash] = std::move(j);
-            new_impl.deleted[hash] = 0;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    bool HashTable<T, U, Compare, Alloc, Hash, Policy>::Contains(const K& key) {
+        auto hash = impl(key);
+        auto old = Migrating();
+        return FindIndex(key, hash) != npos || (old && FindIndexIn(*old, key, hash) != npos);
+    }
+
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    U& HashTable<T, U, Compare, Alloc, Hash, Policy>::Find(const K& key) {
+        auto hash = impl(key);
+        if (auto idx = FindIndex(key, hash); idx != npos) {
+            return _array[idx];
         }
-        //destructor
-        for (int i = 0; i < _capacity; ++i) {
-            std::allocator_traits<Alloc>::destroy(impl, _array + i);
+        if (auto old = Migrating()) {
+            if (auto idx = FindIndexIn(*old, key, hash); idx != npos) {
+                return old->array[idx];
+            }
         }
-        impl.deallocate(_array, _capacity);
-        _rebind.deallocate(_deleted, _capacity);
-        impl = new_impl;
+        throw std::out_of_range("mtl::HashTable::Find: no such key");
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    bool HashTable<T, U, Compare, Alloc, Hash>::Contains(const T& key) {
-        auto hash = impl(key) % _capacity;
-        while (_deleted[hash] != -1 && !impl.compare(_array[hash], key)) {
-            ++hash;
-            if (hash >= _capacity) {
-                hash -= _capacity;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    U* HashTable<T, U, Compare, Alloc, Hash, Policy>::TryFind(const K& key, size_t hash) {
+        if (auto idx = FindIndex(key, hash); idx != npos) {
+            return _array + idx;
+        }
+        if (auto old = Migrating()) {
+            if (auto idx = FindIndexIn(*old, key, hash); idx != npos) {
+                return old->array + idx;
             }
         }
-        return _deleted[hash] == 0;
+        return nullptr;
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    U& HashTable<T, U, Compare, Alloc, Hash>::Find(const T& key) {
-        auto hash = impl(key) % _capacity;
-        while (!_deleted[hash] && !impl.compare(_array[hash], key)) {
-            ++hash;
-            if (hash >= _capacity) {
-                hash -= _capacity;
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename Key, typename Visit>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Batch(size_t n, Key key, Visit visit) {
+        size_t hashes[kBatch];
+        for (size_t begin = 0; begin < n; begin += kBatch) {
+            auto end = std::min(n, begin + kBatch);
+            for (auto i = begin; i < end; ++i) {
+                auto hash = hashes[i - begin] = impl(key(i));
+                auto pos = Home(hash, _capacity);
+                detail::Prefetch(_ctrl + pos);
+                detail::Prefetch(_array + pos);
+                if constexpr (Policy::store_hash) {
+                    detail::Prefetch(impl.hashes + pos);
+                }
+            }
+            // an insert may grow the table in the middle of a chunk, the rest of it is still correct, just not prefetched
+            for (auto i = begin; i < end; ++i) {
+                visit(i, hashes[i - begin]);
             }
         }
+    }
 
-        return _array[hash];
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    template<typename Visit>
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::ForEachParallel(size_t threads, Visit visit) {
+        MigrateStep(SIZE_MAX);
+        threads = std::max<size_t>(1, std::min(threads, _capacity / Group::kWidth));
+        // the ranges start at whole groups, the control bytes are read a group at a time
+        auto range_begin = [this, threads](size_t t) {
+            return t == threads ? _capacity : _capacity * t / threads / Group::kWidth * Group::kWidth;
+        };
+        detail::ParallelFor(threads, [&](size_t t) {
+            const U* elements[kBatch];
+            size_t n = 0;
+            auto end = range_begin(t + 1);
+            for (auto pos = range_begin(t); pos < end; pos += Group::kWidth) {
+                for (auto i: Group(_ctrl + pos).MatchFull()) {
+                    // the last group may reach the mirrored control bytes
+                    if (pos + i >= end) {
+                        break;
+                    }
+                    elements[n++] = _array + pos + i;
+                    if (n == kBatch) {
+                        visit(t, elements, n);
+                        n = 0;
+                    }
+                }
+            }
+            if (n != 0) {
+                visit(t, elements, n);
+            }
+        });
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    typename HashTable<T, U, Compare, Alloc, Hash>::iterator HashTable<T, U, Compare, Alloc, Hash>::begin() {
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    typename HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator HashTable<T, U, Compare, Alloc, Hash, Policy>::begin() {
+        MigrateStep(SIZE_MAX);
         size_t index = 0;
-        while(_deleted[index]){
+        while (index < _capacity && _ctrl[index] < 0) {
             ++index;
         }
         return HashTable::iterator(index, impl);
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
-    typename HashTable<T, U, Compare, Alloc, Hash>::iterator HashTable<T, U, Compare, Alloc, Hash>::end() {
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
+    typename HashTable<T, U, Compare, Alloc, Hash, Policy>::iterator HashTable<T, U, Compare, Alloc, Hash, Policy>::end() {
+        MigrateStep(SIZE_MAX);
         return HashTable::iterator(impl.capacity, impl);
     }
 
-    template<typename T, typename U, typename Compare, typename Alloc, typename Hash>
+    template<typename T, typename U, typename Compare, typename Alloc, typename Hash, typename Policy>
     template<typename KeyByValue>
-    void HashTable<T, U, Compare, Alloc, Hash>::Insert(const T& key, U&& value) {
-        auto hash = impl(key) % _capacity;
-        int32_t idx = -1;
-        while (_deleted[hash] != -1 && !impl.compare(_array[hash], key)) {
-            ++hash;
-            if (hash >= _capacity) {
-                hash -= _capacity;
-            }
-            if (_deleted[hash] && idx == -1) {
-                idx = hash;
-            }
-        }
-        if (_deleted[hash] != -1) {
-            _array[hash] = std::move(value);
-            return;
-        }
-        if (idx < 0) {
-            idx = hash;
-        }
-        _array[idx] = std::move(value);
-        _deleted[idx] = 0;
-        ++_size;
-        if (_size >= _capacity >> 1u) {
-            Rehash(_capacity << 1u, KeyByValue());
-        }
+    void HashTable<T, U, Compare, Alloc, Hash, Policy>::Insert(const T& key, U&& value) {
+        InsertImpl<KeyByValue>(key, std::move(value));
     }
 
-    template<typename T, typename U, typename Alloc = std::allocator<std::pair<T, U>>, typename Hash = std::hash<T>>
+    template<typename T, typename U, typename Alloc = std::allocator<std::pair<T, U>>, typename Hash = hash<T>,
+            typename Policy = hash_policy>
     class hash_map {
     private:
         struct Compare {
-            inline bool operator()(const std::pair<T, U>& pair, T key) const {
+            using is_transparent = void;
+
+            template<typename K>
+            inline bool operator()(const std::pair<T, U>& pair, const K& key) const {
                 return pair.first == key;
             }
         };
@@ -312,163 +2062,567 @@ namespace mtl {
             }
         };
 
-        HashTable<T, std::pair<T, U>, Compare, Alloc, Hash> hashTable;
+        HashTable<T, std::pair<T, U>, Compare, Alloc, Hash, Policy> hashTable;
     public:
+        using iterator = typename HashTable<T, std::pair<T, U>, Compare, Alloc, Hash, Policy>::iterator;
+
         hash_map();
 
-        explicit hash_map(size_t size);
+        explicit hash_map(size_t size, Alloc alloc = Alloc(), Hash hash = Hash());
 
         ~hash_map() = default;
 
+        // throws std::out_of_range if there is no such key, FindOrInsert inserts it instead
         inline U& operator[](const T& key) { return hashTable.Find(key).second; };
 
+        template<typename K> requires detail::transparent<Hash>
+        inline U& operator[](const K& key) { return hashTable.Find(key).second; };
+
         inline bool Contains(const T& key) { return hashTable.Contains(key); };
 
-        inline void Insert(const T& key, const U& value) {
-            hashTable.template Insert<KeyByValue>(key, std::make_pair(key, value));
-        };
+        template<typename K> requires detail::transparent<Hash>
+        inline bool Contains(const K& key) { return hashTable.Contains(key); };
+
+        inline void Insert(const T& key, const U& value) { InsertOrAssign(key, value); };
 
-        inline void Insert(const T& key, U&& value) {
-            hashTable.template Insert<KeyByValue>(key, std::make_pair(key, std::move(value)));
+        inline void Insert(const T& key, U&& value) { InsertOrAssign(key, std::move(value)); };
+
+        // the value is constructed from args only if the key is absent
+        template<typename... Args>
+        inline std::pair<iterator, bool> TryEmplace(const T& key, Args&& ... args) {
+            return hashTable.template TryEmplace<KeyByValue>(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                                             std::forward_as_tuple(std::forward<Args>(args)...));
         };
 
+        template<typename V>
+        inline std::pair<iterator, bool> InsertOrAssign(const T& key, V&& value);
+
+        // builds the pair first, the key has to be known before the probe; the pair is then moved into the slot
+        template<typename... Args>
+        inline std::pair<iterator, bool> Emplace(Args&& ... args);
+
+        // the default-constructed value is inserted if the key is absent
+        inline U& FindOrInsert(const T& key) { return TryEmplace(key).first->second; };
+
+        // result[i] points to the value of keys[i] or is nullptr if there is no such key
+        inline void FindBatch(std::span<const T> keys, std::span<U*> result);
+
+        inline void ContainsBatch(std::span<const T> keys, std::span<bool> result);
+
+        // same as Insert for every pair
+        inline void InsertBatch(std::span<const std::pair<T, U>> pairs);
+
+        // same as Insert for every pair, the table is grown once and filled by threads threads
+        inline void BuildParallel(std::span<const std::pair<T, U>> pairs, size_t threads = detail::DefaultThreads()) {
+            hashTable.template InsertParallel<KeyByValue>(pairs.size(), [pairs](size_t i) { return &pairs[i]; },
+                                                          threads);
+        }
+
         inline void Delete(const T& key) { hashTable.Delete(key); };
 
-        inline typename HashTable<T, std::pair<T, U>, Compare, Alloc, Hash>::iterator
-        begin() { return hashTable.begin(); }
+        template<typename K> requires detail::transparent<Hash>
+        inline void Delete(const K& key) { hashTable.Delete(key); };
+
+        inline iterator begin() { return hashTable.begin(); }
 
-        inline typename HashTable<T, std::pair<T, U>, Compare, Alloc, Hash>::iterator
-        end() { return hashTable.end(); }
+        inline iterator end() { return hashTable.end(); }
 
         inline size_t size() { return hashTable.size(); }
 
         inline size_t capacity() { return hashTable.capacity(); }
+
+        inline size_t memory_usage() { return hashTable.memory_usage(); }
+
+        // probe lengths, rehashes and slot states, with Policy::collect_stats
+        inline hash_stats stats() requires Policy::collect_stats { return hashTable.Stats(); }
+
+        // snapshot of a table of trivially copyable elements, MapFromFile serves it from the page cache
+        inline bool Save(const char* path) { return hashTable.Save(path); }
+
+        inline bool MapFromFile(const char* path) { return hashTable.MapFromFile(path); }
+
+        inline void reserve(size_t size) { hashTable.template Reserve<KeyByValue>(size); }
+
+        // the elements are moved into the grown table by threads threads
+        inline void reserve(size_t size, size_t threads) { hashTable.template Reserve<KeyByValue>(size, threads); }
+
+        inline void shrink_to_fit() { hashTable.template ShrinkToFit<KeyByValue>(); }
     };
 
-    template<typename T, typename U, typename Alloc, typename Hash>
-    hash_map<T, U, Alloc, Hash>::hash_map():hashTable(1) {
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    hash_map<T, U, Alloc, Hash, Policy>::hash_map():hashTable(1) {
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    hash_map<T, U, Alloc, Hash, Policy>::hash_map(size_t size, Alloc alloc, Hash hash):hashTable(size, alloc, hash) {
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    template<typename V>
+    std::pair<typename hash_map<T, U, Alloc, Hash, Policy>::iterator, bool>
+    hash_map<T, U, Alloc, Hash, Policy>::InsertOrAssign(const T& key, V&& value) {
+        auto result = TryEmplace(key, std::forward<V>(value));
+        if (!result.second) {
+            // value wasn't consumed by TryEmplace
+            result.first->second = std::forward<V>(value);
+        }
+        return result;
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    template<typename... Args>
+    std::pair<typename hash_map<T, U, Alloc, Hash, Policy>::iterator, bool>
+    hash_map<T, U, Alloc, Hash, Policy>::Emplace(Args&& ... args) {
+        std::pair<T, U> pair(std::forward<Args>(args)...);
+        return hashTable.template TryEmplace<KeyByValue>(pair.first, std::move(pair));
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    void hash_map<T, U, Alloc, Hash, Policy>::FindBatch(std::span<const T> keys, std::span<U*> result) {
+        // the old arrays of a pending migration are freed before the first pointer is taken, and only the current
+        // arrays are prefetched
+        hashTable.FinishMigration();
+        hashTable.Batch(keys.size(), [&](size_t i) -> const T& { return keys[i]; }, [&](size_t i, size_t hash) {
+            auto pair = hashTable.TryFind(keys[i], hash);
+            result[i] = pair ? &pair->second : nullptr;
+        });
+    }
+
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    void hash_map<T, U, Alloc, Hash, Policy>::ContainsBatch(std::span<const T> keys, std::span<bool> result) {
+        hashTable.FinishMigration();
+        hashTable.Batch(keys.size(), [&](size_t i) -> const T& { return keys[i]; }, [&](size_t i, size_t hash) {
+            result[i] = hashTable.TryFind(keys[i], hash) != nullptr;
+        });
     }
 
-    template<typename T, typename U, typename Alloc, typename Hash>
-    hash_map<T, U, Alloc, Hash>::hash_map(size_t size):hashTable(size) {
+    template<typename T, typename U, typename Alloc, typename Hash, typename Policy>
+    void hash_map<T, U, Alloc, Hash, Policy>::InsertBatch(std::span<const std::pair<T, U>> pairs) {
+        hashTable.Batch(pairs.size(), [&](size_t i) -> const T& { return pairs[i].first; }, [&](size_t i, size_t hash) {
+            auto [it, inserted] = hashTable.template TryEmplaceHashed<KeyByValue>(hash, pairs[i].first, pairs[i]);
+            if (!inserted) {
+                it->second = pairs[i].second;
+            }
+        });
     }
 
-    template<typename T, typename Alloc = std::allocator<T>, typename Hash = std::hash<T>>
+    template<typename T, typename Alloc = std::allocator<T>, typename Hash = hash<T>, typename Policy = hash_policy>
     class hash_set {
     private:
         struct Compare {
-            inline bool operator()(T element, T key) {
+            using is_transparent = void;
+
+            template<typename K>
+            inline bool operator()(const T& element, const K& key) const {
                 return element == key;
             }
         };
 
         struct KeyByValue {
-            inline T operator()(T element) {
+            inline const T& operator()(const T& element) const {
                 return element;
             }
         };
 
-        HashTable<T, T, Compare, Alloc, Hash> hashTable;
+        HashTable<T, T, Compare, Alloc, Hash, Policy> hashTable;
+
+        // pointers to the elements of this set that other contains (present) or doesn't, all of them if other is
+        // nullptr. The probes of a thread go to other kBatch elements at a time
+        inline std::vector<const T*> Select(hash_set* other, bool present, size_t threads);
+
+        inline void InsertAll(const std::vector<const T*>& elements, size_t threads) {
+            hashTable.template InsertParallel<KeyByValue>(elements.size(), [&elements](size_t i) {
+                return elements[i];
+            }, threads);
+        }
 
     public:
+        using iterator = typename HashTable<T, T, Compare, Alloc, Hash, Policy>::iterator;
+
         hash_set();
 
-        explicit hash_set(size_t size);
+        explicit hash_set(size_t size, Alloc alloc = Alloc(), Hash hash = Hash());
 
         ~hash_set() = default;
 
         inline bool Contains(const T& value) { return hashTable.Contains(value); };
 
-        inline void Insert(const T& value) { hashTable.template Insert<KeyByValue>(value, value); };
+        template<typename K> requires detail::transparent<Hash>
+        inline bool Contains(const K& value) { return hashTable.Contains(value); };
+
+        inline void Insert(const T& value) { hashTable.template TryEmplace<KeyByValue>(value, value); };
+
+        // builds the element first, the key has to be known before the probe; it is then moved into the slot
+        template<typename... Args>
+        inline std::pair<iterator, bool> Emplace(Args&& ... args) {
+            T value(std::forward<Args>(args)...);
+            return hashTable.template TryEmplace<KeyByValue>(value, std::move(value));
+        };
+
+        inline const T& FindOrInsert(const T& value) {
+            return *hashTable.template TryEmplace<KeyByValue>(value, value).first;
+        };
+
+        inline void ContainsBatch(std::span<const T> values, std::span<bool> result) {
+            hashTable.FinishMigration();
+            hashTable.Batch(values.size(), [&](size_t i) -> const T& { return values[i]; }, [&](size_t i, size_t hash) {
+                result[i] = hashTable.TryFind(values[i], hash) != nullptr;
+            });
+        };
+
+        inline void InsertBatch(std::span<const T> values) {
+            hashTable.Batch(values.size(), [&](size_t i) -> const T& { return values[i]; }, [&](size_t i, size_t hash) {
+                hashTable.template TryEmplaceHashed<KeyByValue>(hash, values[i], values[i]);
+            });
+        };
+
+        // same as Insert for every value, the table is grown once and filled by threads threads
+        inline void BuildParallel(std::span<const T> values, size_t threads = detail::DefaultThreads()) {
+            hashTable.template InsertParallel<KeyByValue>(values.size(), [values](size_t i) { return &values[i]; },
+                                                          threads);
+        };
+
+        // the set algebra adds the elements of the outcome to result, which must be neither of the operands.
+        // The smaller operand is iterated and the larger one probed, the slots are split between threads threads
+        inline void Union(hash_set& other, hash_set& result, size_t threads = 1);
+
+        inline void Intersect(hash_set& other, hash_set& result, size_t threads = 1);
+
+        // the elements of this set that other doesn't contain, this set is the iterated one
+        inline void Difference(hash_set& other, hash_set& result, size_t threads = 1);
+
+        // whether other contains every element of this set
+        inline bool IsSubset(hash_set& other, size_t threads = 1);
 
         inline void Delete(const T& value) { hashTable.Delete(value); };
 
-        inline typename HashTable<T, T, Compare, Alloc, Hash>::iterator
-        begin() { return hashTable.begin(); }
+        template<typename K> requires detail::transparent<Hash>
+        inline void Delete(const K& value) { hashTable.Delete(value); };
+
+        inline iterator begin() { return hashTable.begin(); }
 
-        inline typename HashTable<T, T, Compare, Alloc, Hash>::iterator
-        end() { return hashTable.end(); }
+        inline iterator end() { return hashTable.end(); }
 
         inline size_t size() { return hashTable.size(); }
 
         inline size_t capacity() { return hashTable.capacity(); }
 
+        inline size_t memory_usage() { return hashTable.memory_usage(); }
+
+        // probe lengths, rehashes and slot states, with Policy::collect_stats
+        inline hash_stats stats() requires Policy::collect_stats { return hashTable.Stats(); }
+
+        // snapshot of a table of trivially copyable elements, MapFromFile serves it from the page cache
+        inline bool Save(const char* path) { return hashTable.Save(path); }
+
+        inline bool MapFromFile(const char* path) { return hashTable.MapFromFile(path); }
+
+        inline void reserve(size_t size) { hashTable.template Reserve<KeyByValue>(size); }
+
+        // the elements are moved into the grown table by threads threads
+        inline void reserve(size_t size, size_t threads) { hashTable.template Reserve<KeyByValue>(size, threads); }
+
+        inline void shrink_to_fit() { hashTable.template ShrinkToFit<KeyByValue>(); }
+
     };
 
-    template<typename T, typename Alloc, typename Hash>
-    hash_set<T, Alloc, Hash>::hash_set():hashTable(1) {
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    hash_set<T, Alloc, Hash, Policy>::hash_set():hashTable(1) {
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    hash_set<T, Alloc, Hash, Policy>::hash_set(size_t size, Alloc alloc, Hash hash):hashTable(size, alloc, hash) {
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    std::vector<const T*> hash_set<T, Alloc, Hash, Policy>::Select(hash_set* other, bool present, size_t threads) {
+        threads = std::max<size_t>(threads, 1);
+        if constexpr (Policy::collect_stats) {
+            // the probe counters are plain integers
+            threads = 1;
+        }
+        if (other) {
+            other->hashTable.FinishMigration();
+        }
+        std::vector<std::vector<const T*>> selected(threads);
+        hashTable.ForEachParallel(threads, [&](size_t t, const T* const* elements, size_t n) {
+            if (!other) {
+                selected[t].insert(selected[t].end(), elements, elements + n);
+                return;
+            }
+            other->hashTable.Batch(n, [elements](size_t i) -> const T& { return *elements[i]; },
+                                   [&](size_t i, size_t hash) {
+                                       if ((other->hashTable.TryFind(*elements[i], hash) != nullptr) == present) {
+                                           selected[t].push_back(elements[i]);
+                                       }
+                                   });
+        });
+        size_t total = 0;
+        for (auto& part: selected) {
+            total += part.size();
+        }
+        std::vector<const T*> result;
+        result.reserve(total);
+        for (auto& part: selected) {
+            result.insert(result.end(), part.begin(), part.end());
+        }
+        return result;
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    void hash_set<T, Alloc, Hash, Policy>::Union(hash_set& other, hash_set& result, size_t threads) {
+        auto small = size() <= other.size() ? this : &other;
+        auto large = small == this ? &other : this;
+        auto elements = large->Select(nullptr, true, threads);
+        auto missing = small->Select(large, false, threads);
+        elements.insert(elements.end(), missing.begin(), missing.end());
+        result.InsertAll(elements, threads);
     }
 
-    template<typename T, typename Alloc, typename Hash>
-    hash_set<T, Alloc, Hash>::hash_set(size_t size):hashTable(size) {
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    void hash_set<T, Alloc, Hash, Policy>::Intersect(hash_set& other, hash_set& result, size_t threads) {
+        auto small = size() <= other.size() ? this : &other;
+        auto large = small == this ? &other : this;
+        result.InsertAll(small->Select(large, true, threads), threads);
     }
 
-    template<typename T, typename Alloc = std::allocator<std::pair<T, int32_t>>, typename Hash = std::hash<T>>
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    void hash_set<T, Alloc, Hash, Policy>::Difference(hash_set& other, hash_set& result, size_t threads) {
+        result.InsertAll(Select(&other, false, threads), threads);
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    bool hash_set<T, Alloc, Hash, Policy>::IsSubset(hash_set& other, size_t threads) {
+        return size() <= other.size() && Select(&other, false, threads).empty();
+    }
+
+    template<typename T, typename Alloc = std::allocator<std::pair<T, int32_t>>, typename Hash = hash<T>,
+            typename Policy = hash_policy>
     class hash_multiset {
     private:
         struct Compare {
-            inline bool operator()(std::pair<T, int32_t> pair, T key) {
+            using is_transparent = void;
+
+            template<typename K>
+            inline bool operator()(const std::pair<T, int32_t>& pair, const K& key) const {
                 return pair.first == key;
             }
         };
 
         struct KeyByValue {
-            inline T operator()(std::pair<T, int32_t> pair) {
+            inline const T& operator()(const std::pair<T, int32_t>& pair) const {
                 return pair.first;
             }
         };
 
-        HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash> hashTable;
+        HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash, Policy> hashTable;
+
+        // the partial counts of CountParallel keep their hashes, so merging them hashes no element again
+        struct PartialPolicy : hash_policy {
+            using index = typename Policy::index;
+            static constexpr double max_load_factor = Policy::max_load_factor;
+            static constexpr double growth_factor = Policy::growth_factor;
+            static constexpr bool store_hash = true;
+        };
+
+        using Partial = HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash, PartialPolicy>;
+
+        template<typename K>
+        inline int32_t CountImpl(const K& value);
     public:
+        using iterator = typename HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash, Policy>::iterator;
+
         hash_multiset();
 
-        explicit hash_multiset(size_t size);
+        explicit hash_multiset(size_t size, Alloc alloc = Alloc(), Hash hash = Hash());
 
         ~hash_multiset() = default;
 
         inline bool Contains(const T& value) { return hashTable.Contains(value); }
 
+        template<typename K> requires detail::transparent<Hash>
+        inline bool Contains(const K& value) { return hashTable.Contains(value); }
+
         inline void Insert(const T& value);
 
         inline void Delete(const T& value) { hashTable.Delete(value); }
 
-        inline int32_t Count(const T& value);
+        template<typename K> requires detail::transparent<Hash>
+        inline void Delete(const K& value) { hashTable.Delete(value); }
+
+        inline int32_t Count(const T& value) { return CountImpl(value); }
+
+        inline void ContainsBatch(std::span<const T> values, std::span<bool> result) {
+            hashTable.FinishMigration();
+            hashTable.Batch(values.size(), [&](size_t i) -> const T& { return values[i]; }, [&](size_t i, size_t hash) {
+                result[i] = hashTable.TryFind(values[i], hash) != nullptr;
+            });
+        }
+
+        inline void CountBatch(std::span<const T> values, std::span<int32_t> result) {
+            hashTable.FinishMigration();
+            hashTable.Batch(values.size(), [&](size_t i) -> const T& { return values[i]; }, [&](size_t i, size_t hash) {
+                auto pair = hashTable.TryFind(values[i], hash);
+                result[i] = pair ? pair->second : 0;
+            });
+        }
+
+        inline void InsertBatch(std::span<const T> values) {
+            hashTable.Batch(values.size(), [&](size_t i) -> const T& { return values[i]; }, [&](size_t i, size_t hash) {
+                ++hashTable.template TryEmplaceHashed<KeyByValue>(hash, values[i], values[i], 0).first->second;
+            });
+        }
+
+        template<typename K> requires detail::transparent<Hash>
+        inline int32_t Count(const K& value) { return CountImpl(value); }
+
+        // same as Insert for every value. Every thread counts a chunk of the values into tables of its own, one
+        // per hash range; then every range is folded by one thread, and the ranges are placed into this multiset
+        // in parallel with the hashes kept from the first pass
+        inline void CountParallel(std::span<const T> values, size_t threads = detail::DefaultThreads());
 
-        inline typename HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash>::iterator
-        begin() { return hashTable.begin(); }
+        // the k most frequent elements with their counts, the most frequent first
+        inline std::vector<std::pair<T, int32_t>> TopK(size_t k, size_t threads = 1);
 
-        inline typename HashTable<T, std::pair<T, int32_t>, Compare, Alloc, Hash>::iterator
-        end() { return hashTable.end(); }
+        inline iterator begin() { return hashTable.begin(); }
+
+        inline iterator end() { return hashTable.end(); }
 
         inline size_t size() { return hashTable.size(); }
 
         inline size_t capacity() { return hashTable.capacity(); }
 
+        inline size_t memory_usage() { return hashTable.memory_usage(); }
+
+        // probe lengths, rehashes and slot states, with Policy::collect_stats
+        inline hash_stats stats() requires Policy::collect_stats { return hashTable.Stats(); }
+
+        // snapshot of a table of trivially copyable elements, MapFromFile serves it from the page cache
+        inline bool Save(const char* path) { return hashTable.Save(path); }
+
+        inline bool MapFromFile(const char* path) { return hashTable.MapFromFile(path); }
+
+        inline void reserve(size_t size) { hashTable.template Reserve<KeyByValue>(size); }
+
+        // the elements are moved into the grown table by threads threads
+        inline void reserve(size_t size, size_t threads) { hashTable.template Reserve<KeyByValue>(size, threads); }
+
+        inline void shrink_to_fit() { hashTable.template ShrinkToFit<KeyByValue>(); }
+
     };
 
-    template<typename T, typename Alloc, typename Hash>
-    hash_multiset<T, Alloc, Hash>::hash_multiset():hashTable(1) {
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    hash_multiset<T, Alloc, Hash, Policy>::hash_multiset():hashTable(1) {
     }
 
-    template<typename T, typename Alloc, typename Hash>
-    hash_multiset<T, Alloc, Hash>::hash_multiset(size_t size):hashTable(size) {
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    hash_multiset<T, Alloc, Hash, Policy>::hash_multiset(size_t size, Alloc alloc, Hash hash):hashTable(size, alloc, hash) {
     }
 
-    template<typename T, typename Alloc, typename Hash>
-    void hash_multiset<T, Alloc, Hash>::Insert(const T& value) {
-        if (hashTable.Contains(value)) {
-            ++hashTable.Find(value).second;
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    void hash_multiset<T, Alloc, Hash, Policy>::Insert(const T& value) {
+        ++hashTable.template TryEmplace<KeyByValue>(value, value, 0).first->second;
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    void hash_multiset<T, Alloc, Hash, Policy>::CountParallel(std::span<const T> values, size_t threads) {
+        // smaller chunks cost more in tables and threads than they save
+        constexpr size_t kMinChunk = 4096;
+        threads = std::min(threads, values.size() / kMinChunk);
+        if (threads <= 1) {
+            InsertBatch(values);
             return;
         }
-        hashTable.template Insert<KeyByValue>(value, std::make_pair(value, 1));
+        using Element = std::pair<T, int32_t>;
+        auto range_of = [threads](size_t hash) { return detail::MulHigh(hash * 0xD6E8FEB86659FD93ull, threads); };
+        // partials[t * threads + r] counts the values of chunk t with hashes in range r
+        std::vector<std::unique_ptr<Partial>> partials(threads * threads);
+        detail::ParallelFor(threads, [&](size_t t) {
+            for (size_t r = 0; r < threads; ++r) {
+                partials[t * threads + r] = std::make_unique<Partial>(1, hashTable.Allocator(),
+                                                                      hashTable.HashFunction());
+            }
+            auto& hash = hashTable.HashFunction();
+            for (auto i = values.size() * t / threads; i < values.size() * (t + 1) / threads; ++i) {
+                auto h = hash(values[i]);
+                ++partials[t * threads + range_of(h)]->template TryEmplaceHashed<KeyByValue>(h, values[i], values[i],
+                                                                                             0).first->second;
+            }
+        });
+        // the keys of different ranges differ, so the ranges are folded independently
+        detail::ParallelFor(threads, [&](size_t r) {
+            auto& range = *partials[r];
+            for (size_t t = 1; t < threads; ++t) {
+                auto& partial = *partials[t * threads + r];
+                partial.ForEachParallel(1, [&](size_t, const Element* const* elements, size_t n) {
+                    for (size_t i = 0; i < n; ++i) {
+                        auto [it, inserted] = range.template TryEmplaceHashed<KeyByValue>(
+                                partial.StoredHash(elements[i]), elements[i]->first, *elements[i]);
+                        if (!inserted) {
+                            it->second += elements[i]->second;
+                        }
+                    }
+                });
+                partials[t * threads + r].reset();
+            }
+        });
+        std::vector<const Element*> elements;
+        std::vector<size_t> hashes;
+        for (size_t r = 0; r < threads; ++r) {
+            auto& range = *partials[r];
+            range.ForEachParallel(1, [&](size_t, const Element* const* chunk, size_t n) {
+                for (size_t i = 0; i < n; ++i) {
+                    elements.push_back(chunk[i]);
+                    hashes.push_back(range.StoredHash(chunk[i]));
+                }
+            });
+        }
+        hashTable.template MergeParallel<KeyByValue>(elements.size(), [&elements](size_t i) {
+            return elements[i];
+        }, [&hashes](size_t i) {
+            return hashes[i];
+        }, [](Element& present, const Element& element) { present.second += element.second; }, threads);
     }
 
-    template<typename T, typename Alloc, typename Hash>
-    int32_t hash_multiset<T, Alloc, Hash>::Count(const T& value) {
-        if (hashTable.Contains(value)) {
-            return hashTable.Find(value).second;
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    std::vector<std::pair<T, int32_t>> hash_multiset<T, Alloc, Hash, Policy>::TopK(size_t k, size_t threads) {
+        using Element = std::pair<T, int32_t>;
+        threads = std::max<size_t>(threads, 1);
+        // min-heaps by count, the front is the least frequent of the k kept so far
+        auto more_frequent = [](const Element* a, const Element* b) { return a->second > b->second; };
+        std::vector<std::vector<const Element*>> heaps(threads);
+        hashTable.ForEachParallel(threads, [&](size_t t, const Element* const* elements, size_t n) {
+            auto& heap = heaps[t];
+            for (size_t i = 0; i < n; ++i) {
+                if (heap.size() < k) {
+                    heap.push_back(elements[i]);
+                    std::push_heap(heap.begin(), heap.end(), more_frequent);
+                } else if (k != 0 && elements[i]->second > heap.front()->second) {
+                    std::pop_heap(heap.begin(), heap.end(), more_frequent);
+                    heap.back() = elements[i];
+                    std::push_heap(heap.begin(), heap.end(), more_frequent);
+                }
+            }
+        });
+        std::vector<const Element*> candidates;
+        for (auto& heap: heaps) {
+            candidates.insert(candidates.end(), heap.begin(), heap.end());
+        }
+        k = std::min(k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(), more_frequent);
+        std::vector<Element> result;
+        result.reserve(k);
+        for (size_t i = 0; i < k; ++i) {
+            result.push_back(*candidates[i]);
         }
-        return 0;
+        return result;
+    }
+
+    template<typename T, typename Alloc, typename Hash, typename Policy>
+    template<typename K>
+    int32_t hash_multiset<T, Alloc, Hash, Policy>::CountImpl(const K& value) {
+        auto pair = hashTable.TryFind(value);
+        return pair ? pair->second : 0;
     }
 
 }
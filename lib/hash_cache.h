@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+#include "hash.h"
+
+namespace mtl {
+
+    struct cache_stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // cache of at most max_size entries over a HashTable that is allocated once and never grows. A new key in a
+    // full cache evicts an entry chosen by CLOCK: the hand walks the slots, clears the reference bits set by the
+    // hits and takes the first entry whose bit is already clear, so the entries used since the hand last passed
+    // them are kept. The bit lives in the slot next to the value and travels with it when the tombstones are
+    // dropped.
+    // Only Find and FindOrLoad count hits and misses; Insert, Delete and Contains don't touch them, and evictions are
+    // counted by whatever inserts the new key
+    template<typename K, typename V, typename Hash = hash<K>, typename Policy = hash_policy>
+    class hash_cache {
+    private:
+        struct Entry {
+            K key;
+            V value;
+            bool referenced;
+        };
+
+        struct Compare {
+            using is_transparent = void;
+
+            template<typename X>
+            inline bool operator()(const Entry& entry, const X& key) const {
+                return entry.key == key;
+            }
+        };
+
+        struct KeyByValue {
+            inline const K& operator()(const Entry& entry) const {
+                return entry.key;
+            }
+        };
+
+        // the tombstones left by the evictions are dropped in place every max_size / kSlack evictions or so
+        static constexpr size_t kSlack = 4;
+
+        HashTable<K, Entry, Compare, std::allocator<Entry>, Hash, Policy> table;
+        size_t max_size_;
+        size_t hand;
+        cache_stats stats_;
+
+        inline void Evict();
+
+        template<typename X>
+        inline V& Put(const K& key, X&& value);
+    public:
+        explicit hash_cache(size_t max_size, Hash hash = Hash());
+
+        // the value of the key or nullptr, a hit marks the entry as used
+        inline V* Find(const K& key);
+
+        inline bool Contains(const K& key) { return table.Contains(key); }
+
+        // inserts or overwrites, a new key may evict another one
+        template<typename X>
+        inline void Insert(const K& key, X&& value) { Put(key, std::forward<X>(value)); }
+
+        // the value of the key, load(key) is inserted on a miss
+        template<typename Load>
+        inline V& FindOrLoad(const K& key, Load load);
+
+        // returns whether the key was present
+        inline bool Delete(const K& key) { return table.Delete(key); }
+
+        inline size_t size() { return table.size(); }
+
+        inline size_t max_size() const { return max_size_; }
+
+        // fixed at construction
+        inline size_t memory_usage() { return table.memory_usage(); }
+
+        inline const cache_stats& stats() const { return stats_; }
+    };
+
+    template<typename K, typename V, typename Hash, typename Policy>
+    hash_cache<K, V, Hash, Policy>::hash_cache(size_t max_size, Hash hash):
+            table(std::max<size_t>(max_size, 1) + max_size / kSlack + 1, std::allocator<Entry>(), hash),
+            max_size_(std::max<size_t>(max_size, 1)), hand(0) {
+    }
+
+    template<typename K, typename V, typename Hash, typename Policy>
+    void hash_cache<K, V, Hash, Policy>::Evict() {
+        while (true) {
+            auto idx = hand;
+            hand = hand + 1 == table.capacity() ? 0 : hand + 1;
+            if (!table.IsFull(idx)) {
+                continue;
+            }
+            auto& entry = table.GetByIdx(idx);
+            if (entry.referenced) {
+                entry.referenced = false;
+                continue;
+            }
+            table.Delete(entry.key);
+            ++stats_.evictions;
+            return;
+        }
+    }
+
+    template<typename K, typename V, typename Hash, typename Policy>
+    V* hash_cache<K, V, Hash, Policy>::Find(const K& key) {
+        if (auto entry = table.TryFind(key)) {
+            entry->referenced = true;
+            ++stats_.hits;
+            return &entry->value;
+        }
+        ++stats_.misses;
+        return nullptr;
+    }
+
+    template<typename K, typename V, typename Hash, typename Policy>
+    template<typename X>
+    V& hash_cache<K, V, Hash, Policy>::Put(const K& key, X&& value) {
+        auto hash = table.HashOf(key);
+        if (auto entry = table.TryFind(key, hash)) {
+            entry->value = std::forward<X>(value);
+            entry->referenced = true;
+            return entry->value;
+        }
+        if (table.size() >= max_size_) {
+            Evict();
+        }
+        // the slack above max_size keeps the insert from growing the table
+        if (table.Headroom() <= 1) {
+            table.DropTombstones(KeyByValue());
+        }
+        // a new entry may land just ahead of the hand, it survives the first pass as if it had been hit
+        return table.template TryEmplaceHashed<KeyByValue>(hash, key, Entry{key, V(std::forward<X>(value)),
+                                                                            true}).first->value;
+    }
+
+    template<typename K, typename V, typename Hash, typename Policy>
+    template<typename Load>
+    V& hash_cache<K, V, Hash, Policy>::FindOrLoad(const K& key, Load load) {
+        if (auto value = Find(key)) {
+            return *value;
+        }
+        return Put(key, load(key));
+    }
+
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <memory>
+#include <new>
+
+#include "hash.h"
+
+#if defined(MTL_HASH_MMAP) && __has_include(<sys/syscall.h>)
+#include <sys/syscall.h>
+#endif
+
+namespace mtl {
+
+    enum class numa_policy {
+        local,// the pages land on the node of the thread that touches them first
+        bind,// only on the nodes of huge_page_options::nodes
+        interleave// round-robin over the nodes of huge_page_options::nodes
+    };
+
+    struct huge_page_options {
+        size_t threshold = size_t(1) << 21u;// smaller allocations go to the base allocator
+        bool hugetlb = false;// take explicit huge pages (MAP_HUGETLB), transparent huge pages if the pool is empty
+        size_t prefault_threads = 0;// fault all the pages in at allocation with this many threads, 0 = on first touch
+        numa_policy numa = numa_policy::local;
+        uint64_t nodes = 0;// bit i stands for the NUMA node i
+
+        bool operator==(const huge_page_options&) const = default;
+    };
+
+    namespace detail {
+
+        constexpr size_t kHugePageSize = size_t(1) << 21u;
+
+        inline void* MapHugePages(size_t length, const huge_page_options& options) {
+#if defined(MTL_HASH_MMAP)
+            void* address = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+            if (options.hugetlb) {
+                address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            }
+#endif
+            if (address == MAP_FAILED) {
+                // over-map by a huge page and trim both ends, transparent huge pages need 2MB-aligned ranges
+                auto raw = mmap(nullptr, length + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1, 0);
+                if (raw == MAP_FAILED) {
+                    return nullptr;
+                }
+                auto begin = reinterpret_cast<uintptr_t>(raw);
+                auto aligned = (begin + kHugePageSize - 1) & ~(kHugePageSize - 1);
+                if (aligned != begin) {
+                    munmap(raw, aligned - begin);
+                }
+                munmap(reinterpret_cast<void*>(aligned + length), begin + kHugePageSize - aligned);
+                address = reinterpret_cast<void*>(aligned);
+#if defined(MADV_HUGEPAGE)
+                madvise(address, length, MADV_HUGEPAGE);
+#endif
+            }
+#if defined(SYS_mbind)
+            // the numbers of MPOL_BIND and MPOL_INTERLEAVE, a failure (no NUMA, no such node) keeps the local policy
+            if (options.numa != numa_policy::local && options.nodes != 0) {
+                unsigned long mask = options.nodes;
+                syscall(SYS_mbind, address, length, options.numa == numa_policy::bind ? 2 : 3, &mask,
+                        sizeof(mask) * 8 + 1, 0);
+            }
+#endif
+            if (options.prefault_threads > 0) {
+                auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+                auto pages = length / page, threads = std::min(options.prefault_threads, pages);
+                ParallelFor(threads, [address, page, pages, threads](size_t t) {
+                    auto bytes = static_cast<volatile char*>(address);
+                    for (auto i = pages * t / threads; i < pages * (t + 1) / threads; ++i) {
+                        bytes[i * page] = 0;
+                    }
+                });
+            }
+            return address;
+#else
+            return nullptr;
+#endif
+        }
+
+        inline void UnmapHugePages(void* address, size_t length) {
+#if defined(MTL_HASH_MMAP)
+            munmap(address, length);
+#endif
+        }
+
+    }
+
+    // allocator for the slot and control arrays of giant tables: the allocations from options.threshold bytes are
+    // mapped directly and backed by huge pages, so random probes miss the TLB far less often, and can be bound to
+    // or interleaved across NUMA nodes. The smaller ones, and all of them without mmap, are passed to Base.
+    // Usable as the Alloc of hash_map, hash_set and hash_multiset:
+    // mtl::hash_map<K, V, mtl::huge_page_allocator<std::pair<K, V>>> map(n, mtl::huge_page_allocator<std::pair<K, V>>(options));
+    template<typename T, typename Base = std::allocator<T>>
+    class huge_page_allocator {
+    public:
+        using value_type = T;
+
+        template<typename X>
+        struct rebind {
+            using other = huge_page_allocator<X, typename std::allocator_traits<Base>::template rebind_alloc<X>>;
+        };
+
+        huge_page_allocator() = default;
+
+        explicit huge_page_allocator(const huge_page_options& options, const Base& base = Base()) :
+                options(options), base(base) {}
+
+        template<typename X, typename B>
+        huge_page_allocator(const huge_page_allocator<X, B>& other) : options(other.options), base(other.base) {}
+
+        T* allocate(size_t n);
+
+        void deallocate(T* p, size_t n);
+
+        template<typename X, typename B>
+        bool operator==(const huge_page_allocator<X, B>& other) const {
+            return options == other.options && base == other.base;
+        }
+
+    private:
+        template<typename, typename>
+        friend class huge_page_allocator;
+
+        huge_page_options options;
+        Base base;
+
+        // the mapped length of n elements, 0 if they go to the base allocator
+        size_t Mapped(size_t n) const;
+    };
+
+    template<typename T, typename Base>
+    size_t huge_page_allocator<T, Base>::Mapped(size_t n) const {
+#if defined(MTL_HASH_MMAP)
+        auto bytes = n * sizeof(T);
+        if (bytes >= options.threshold && bytes > 0) {
+            return (bytes + detail::kHugePageSize - 1) & ~(detail::kHugePageSize - 1);
+        }
+#endif
+        return 0;
+    }
+
+    template<typename T, typename Base>
+    T* huge_page_allocator<T, Base>::allocate(size_t n) {
+        auto length = Mapped(n);
+        if (length == 0) {
+            return std::allocator_traits<Base>::allocate(base, n);
+        }
+        auto address = detail::MapHugePages(length, options);
+        if (address == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(address);
+    }
+
+    template<typename T, typename Base>
+    void huge_page_allocator<T, Base>::deallocate(T* p, size_t n) {
+        auto length = Mapped(n);
+        if (length == 0) {
+            std::allocator_traits<Base>::deallocate(base, p, n);
+        } else {
+            detail::UnmapHugePages(p, length);
+        }
+    }
+
+}
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#include "hash.h"
+
+namespace mtl {
+
+    namespace detail {
+
+        // enums have no value that is surely not an enumerator, their sentinels are passed explicitly
+        template<typename T>
+        concept integer_key_with_default_sentinels = std::is_integral_v<T>;
+
+        // the largest value of an integer type minus offset, the default sentinels
+        template<integer_key_with_default_sentinels T, int Offset>
+        constexpr T DefaultSentinel() {
+            return static_cast<T>(std::numeric_limits<T>::max() - Offset);
+        }
+
+        // linear probing over a single array of elements without control bytes: two key values reserved by the
+        // user mark the never used and the deleted slots, so a probe reads only the slots themselves.
+        // Free slots hold KeyOf::Free(EmptyKey or DeletedKey), every slot is always constructed
+        template<typename T, typename Element, typename KeyOf, T EmptyKey, T DeletedKey, typename Alloc,
+                typename Hash, typename Policy>
+        class SentinelTable {
+            static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "sentinel keys are integers or enums");
+            static_assert(EmptyKey != DeletedKey, "the empty and the deleted keys must differ");
+            static_assert(!Policy::robin_hood && Policy::incremental_rehash == 0 && !Policy::store_hash &&
+                          !Policy::collect_stats && Policy::inline_capacity == 0,
+                          "sentinel tables take only index, max_load_factor and growth_factor from the policy");
+            static_assert(Policy::max_load_factor > 0 && Policy::max_load_factor < 1,
+                          "max_load_factor must leave empty slots to end the probe sequences");
+        public:
+            static constexpr size_t npos = SIZE_MAX;
+
+            class iterator {
+            public:
+                iterator(Element* slot, Element* last) : slot(slot), last(last) { Skip(); }
+
+                inline iterator& operator++() {
+                    ++slot;
+                    Skip();
+                    return *this;
+                }
+
+                inline bool operator==(const iterator& other) const { return slot == other.slot; }
+
+                inline Element& operator*() { return *slot; }
+
+                inline Element* operator->() { return slot; }
+
+            private:
+                inline void Skip() {
+                    while (slot != last && IsFree(*slot)) {
+                        ++slot;
+                    }
+                }
+
+                Element* slot;
+                Element* last;
+            };
+
+            SentinelTable(size_t size, Alloc alloc) : alloc(alloc), size(0), tombstones(0) {
+                Allocate(CapacityFor(size));
+            }
+
+            SentinelTable(const SentinelTable& other) = delete;
+
+            SentinelTable& operator=(const SentinelTable& other) = delete;
+
+            // the array is taken over, other is left an empty table without one until its first insert
+            SentinelTable(SentinelTable&& other) noexcept: alloc(other.alloc), hash(other.hash), array(other.array),
+                                                           size(other.size), capacity(other.capacity),
+                                                           tombstones(other.tombstones) {
+                other.Reset();
+            }
+
+            SentinelTable& operator=(SentinelTable&& other) noexcept {
+                if (this != &other) {
+                    Deallocate(array, capacity);
+                    alloc = other.alloc;
+                    hash = other.hash;
+                    array = other.array;
+                    size = other.size;
+                    capacity = other.capacity;
+                    tombstones = other.tombstones;
+                    other.Reset();
+                }
+                return *this;
+            }
+
+            ~SentinelTable() { Deallocate(array, capacity); }
+
+            template<typename K>
+            inline size_t FindIndex(const K& key) {
+                if (key == EmptyKey || key == DeletedKey || capacity == 0) {
+                    return npos;
+                }
+                for (auto pos = Policy::index::Index(hash(key), capacity);; pos = Next(pos)) {
+                    auto& slot_key = KeyOf::Key(array[pos]);
+                    if (slot_key == key) {
+                        return pos;
+                    }
+                    if (slot_key == EmptyKey) {
+                        return npos;
+                    }
+                }
+            }
+
+            // make() builds the element of key if it is absent, before the arrays change.
+            // Returns the index of the element with the key and whether it was inserted
+            template<typename Make>
+            std::pair<size_t, bool> TryEmplace(T key, Make make);
+
+            bool Delete(T key);
+
+            void Rehash(size_t new_capacity);
+
+            // grows the table so that size elements fit in without a Rehash
+            void Reserve(size_t size) {
+                if (CapacityFor(size) > capacity) {
+                    Rehash(CapacityFor(size));
+                }
+            }
+
+            void ShrinkToFit() {
+                if (CapacityFor(size) < capacity || tombstones != 0) {
+                    Rehash(CapacityFor(size));
+                }
+            }
+
+            inline Element& operator[](size_t idx) { return array[idx]; }
+
+            inline iterator At(size_t idx) { return iterator(array + idx, array + capacity); }
+
+            inline iterator begin() { return iterator(array, array + capacity); }
+
+            inline iterator end() { return iterator(array + capacity, array + capacity); }
+
+            inline size_t Size() const { return size; }
+
+            inline size_t Capacity() const { return capacity; }
+
+            inline size_t MemoryUsage() const { return capacity * sizeof(Element); }
+
+        private:
+            static inline bool IsFree(const Element& element) {
+                return KeyOf::Key(element) == EmptyKey || KeyOf::Key(element) == DeletedKey;
+            }
+
+            static inline size_t CapacityFor(size_t size) {
+                auto capacity = Policy::index::Capacity(
+                        std::max(static_cast<size_t>(static_cast<double>(size + 1) / Policy::max_load_factor),
+                                 size_t(8)));
+                while (Limit(capacity) <= size) {
+                    capacity = Policy::index::Capacity(capacity + 1);
+                }
+                return capacity;
+            }
+
+            static inline size_t Limit(size_t capacity) {
+                return static_cast<size_t>(static_cast<double>(capacity) * Policy::max_load_factor);
+            }
+
+            inline size_t Next(size_t pos) const { return pos + 1 == capacity ? 0 : pos + 1; }
+
+            // the array was moved out, the next insert allocates a new one
+            void Reset() {
+                array = nullptr;
+                size = 0;
+                capacity = 0;
+                tombstones = 0;
+            }
+
+            inline size_t FindFree(T key) {
+                auto pos = Policy::index::Index(hash(key), capacity);
+                while (!IsFree(array[pos])) {
+                    pos = Next(pos);
+                }
+                return pos;
+            }
+
+            void Allocate(size_t new_capacity) {
+                capacity = new_capacity;
+                array = std::allocator_traits<Alloc>::allocate(alloc, capacity);
+                for (size_t i = 0; i < capacity; ++i) {
+                    std::allocator_traits<Alloc>::construct(alloc, array + i, KeyOf::Free(EmptyKey));
+                }
+            }
+
+            void Deallocate(Element* old_array, size_t old_capacity) {
+                if (old_array == nullptr) {
+                    return;
+                }
+                for (size_t i = 0; i < old_capacity; ++i) {
+                    std::allocator_traits<Alloc>::destroy(alloc, old_array + i);
+                }
+                std::allocator_traits<Alloc>::deallocate(alloc, old_array, old_capacity);
+            }
+
+            [[no_unique_address]] Alloc alloc;
+            [[no_unique_address]] Hash hash;
+            Element* array;
+            size_t size;
+            size_t capacity;
+            size_t tombstones;
+        };
+
+        template<typename T, typename Element, typename KeyOf, T EmptyKey, T DeletedKey, typename Alloc,
+                typename Hash, typename Policy>
+        template<typename Make>
+        std::pair<size_t, bool>
+        SentinelTable<T, Element, KeyOf, EmptyKey, DeletedKey, Alloc, Hash, Policy>::TryEmplace(T key, Make make) {
+            if (key == EmptyKey || key == DeletedKey) {
+                throw std::invalid_argument("the sentinel keys can't be inserted");
+            }
+            if (capacity == 0) {
+                Allocate(CapacityFor(0));
+            }
+            auto free = npos;
+            for (auto pos = Policy::index::Index(hash(key), capacity);; pos = Next(pos)) {
+                auto slot_key = KeyOf::Key(array[pos]);
+                if (slot_key == key) {
+                    return {pos, false};
+                }
+                if (slot_key == DeletedKey && free == npos) {
+                    free = pos;
+                }
+                if (slot_key == EmptyKey) {
+                    if (free == npos) {
+                        free = pos;
+                    }
+                    break;
+                }
+            }
+            Element element = make();
+            if (KeyOf::Key(array[free]) == DeletedKey) {
+                --tombstones;
+            } else if (size + 1 + tombstones >= Limit(capacity)) {
+                // a table clogged with tombstones is cleaned up without growing
+                Rehash(size + 1 >= Limit(capacity) >> 1u ? std::max(
+                        static_cast<size_t>(static_cast<double>(capacity) * Policy::growth_factor), capacity + 1)
+                                                         : capacity);
+                free = FindFree(key);
+            }
+            array[free] = std::move(element);
+            ++size;
+            return {free, true};
+        }
+
+        template<typename T, typename Element, typename KeyOf, T EmptyKey, T DeletedKey, typename Alloc,
+                typename Hash, typename Policy>
+        bool SentinelTable<T, Element, KeyOf, EmptyKey, DeletedKey, Alloc, Hash, Policy>::Delete(T key) {
+            auto idx = FindIndex(key);
+            if (idx == npos) {
+                return false;
+            }
+            // no probe sequence passes through the slot if the next one is empty
+            if (KeyOf::Key(array[Next(idx)]) == EmptyKey) {
+                array[idx] = KeyOf::Free(EmptyKey);
+            } else {
+                array[idx] = KeyOf::Free(DeletedKey);
+                ++tombstones;
+            }
+            --size;
+            return true;
+        }
+
+        template<typename T, typename Element, typename KeyOf, T EmptyKey, T DeletedKey, typename Alloc,
+                typename Hash, typename Policy>
+        void SentinelTable<T, Element, KeyOf, EmptyKey, DeletedKey, Alloc, Hash, Policy>::Rehash(size_t new_capacity) {
+            auto old_array = array;
+            auto old_capacity = capacity;
+            Allocate(Policy::index::Capacity(std::max(new_capacity, size_t(8))));
+            tombstones = 0;
+            for (size_t i = 0; i < old_capacity; ++i) {
+                if (!IsFree(old_array[i])) {
+                    array[FindFree(KeyOf::Key(old_array[i]))] = std::move(old_array[i]);
+                }
+            }
+            Deallocate(old_array, old_capacity);
+        }
+
+    }
+
+    // hash_map for integer (or enum) keys without the control bytes: EmptyKey and DeletedKey are reserved to
+    // mark the free slots and can't be inserted, the two largest integers by default and required for enums.
+    // A probe reads only the slots, and the table takes capacity * sizeof(std::pair<T, U>) bytes. Every slot
+    // holds a constructed value, so U must be default constructible; deleted values are reset to U()
+    template<typename T, typename U, T EmptyKey = detail::DefaultSentinel<T, 0>(),
+            T DeletedKey = detail::DefaultSentinel<T, 1>(), typename Alloc = std::allocator<std::pair<T, U>>,
+            typename Hash = hash<T>, typename Policy = hash_policy>
+    class sentinel_hash_map {
+    private:
+        struct KeyOf {
+            static inline const T& Key(const std::pair<T, U>& pair) { return pair.first; }
+
+            static inline std::pair<T, U> Free(T key) { return {key, U()}; }
+        };
+
+        detail::SentinelTable<T, std::pair<T, U>, KeyOf, EmptyKey, DeletedKey, Alloc, Hash, Policy> table;
+    public:
+        using iterator = typename decltype(table)::iterator;
+
+        sentinel_hash_map() : table(1, Alloc()) {}
+
+        explicit sentinel_hash_map(size_t size, Alloc alloc = Alloc()) : table(size, alloc) {}
+
+        inline U& operator[](T key) { return FindOrInsert(key); }
+
+        inline bool Contains(T key) { return table.FindIndex(key) != table.npos; }
+
+        // nullptr if there is no such key
+        inline U* TryFind(T key) {
+            auto idx = table.FindIndex(key);
+            return idx == table.npos ? nullptr : &table[idx].second;
+        }
+
+        inline void Insert(T key, const U& value) { InsertOrAssign(key, value); }
+
+        inline void Insert(T key, U&& value) { InsertOrAssign(key, std::move(value)); }
+
+        // the value is constructed from args only if the key is absent
+        template<typename... Args>
+        inline std::pair<iterator, bool> TryEmplace(T key, Args&& ... args) {
+            auto [idx, inserted] = table.TryEmplace(key, [&] {
+                return std::pair<T, U>(std::piecewise_construct, std::forward_as_tuple(key),
+                                       std::forward_as_tuple(std::forward<Args>(args)...));
+            });
+            return {table.At(idx), inserted};
+        }
+
+        template<typename V>
+        inline std::pair<iterator, bool> InsertOrAssign(T key, V&& value) {
+            auto result = TryEmplace(key, std::forward<V>(value));
+            if (!result.second) {
+                result.first->second = std::forward<V>(value);
+            }
+            return result;
+        }
+
+        // the default-constructed value is inserted if the key is absent
+        inline U& FindOrInsert(T key) { return TryEmplace(key).first->second; }
+
+        // returns whether the key was present
+        inline bool Delete(T key) { return table.Delete(key); }
+
+        inline iterator begin() { return table.begin(); }
+
+        inline iterator end() { return table.end(); }
+
+        inline size_t size() { return table.Size(); }
+
+        inline size_t capacity() { return table.Capacity(); }
+
+        inline size_t memory_usage() { return table.MemoryUsage(); }
+
+        inline void reserve(size_t size) { table.Reserve(size); }
+
+        inline void shrink_to_fit() { table.ShrinkToFit(); }
+    };
+
+    template<typename T, T EmptyKey = detail::DefaultSentinel<T, 0>(), T DeletedKey = detail::DefaultSentinel<T, 1>(),
+            typename Alloc = std::allocator<T>, typename Hash = hash<T>, typename Policy = hash_policy>
+    class sentinel_hash_set {
+    private:
+        struct KeyOf {
+            static inline const T& Key(const T& value) { return value; }
+
+            static inline T Free(T key) { return key; }
+        };
+
+        detail::SentinelTable<T, T, KeyOf, EmptyKey, DeletedKey, Alloc, Hash, Policy> table;
+    public:
+        using iterator = typename decltype(table)::iterator;
+
+        sentinel_hash_set() : table(1, Alloc()) {}
+
+        explicit sentinel_hash_set(size_t size, Alloc alloc = Alloc()) : table(size, alloc) {}
+
+        inline bool Contains(T value) { return table.FindIndex(value) != table.npos; }
+
+        // returns whether the value was inserted
+        inline bool Insert(T value) { return table.TryEmplace(value, [value] { return value; }).second; }
+
+        // returns whether the value was present
+        inline bool Delete(T value) { return table.Delete(value); }
+
+        inline iterator begin() { return table.begin(); }
+
+        inline iterator end() { return table.end(); }
+
+        inline size_t size() { return table.Size(); }
+
+        inline size_t capacity() { return table.Capacity(); }
+
+        inline size_t memory_usage() { return table.MemoryUsage(); }
+
+        inline void reserve(size_t size) { table.Reserve(size); }
+
+        inline void shrink_to_fit() { table.ShrinkToFit(); }
+    };
+
+}
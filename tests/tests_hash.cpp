@@ -3,82 +3,20 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <iostream>
+#include <array>
+#include <list>
 #include <map>
+#include <random>
+#include <thread>
 
 #include "lib/hash.h"
+#include "lib/concurrent_hash.h"
+#include "lib/hash_cache.h"
+#include "lib/frozen_hash.h"
+#include "lib/huge_page_allocator.h"
+#include "lib/sentinel_hash.h"
 
 
-TEST(PerformanceHashMapTest, InsertTest) {
-    std::cout << "InsertTest\n";
-    mtl::hash_map<int, int> MTL_MAP(5e6);
-    std::unordered_map<int, int> STD_Map(5e6);
-    std::vector<std::pair<int, int>> tests;
-    for (int i = 0; i < 1e6; ++i) {
-        tests.emplace_back(rand(), rand());
-    }
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        MTL_MAP.Insert(tests[i].first, tests[i].second);
-    }
-    auto end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-    start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        STD_Map[tests[i].first] = tests[i].second;
-    }
-    end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-}
-
-TEST(PerformanceHashMapTest, ContainsTest) {
-    std::cout << "ContainsTest\n";
-    mtl::hash_map<int, int> MTL_MAP(5e6);
-    std::unordered_map<int, int> STD_Map(5e6);
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        auto key = rand(), value = rand();
-        MTL_MAP.Insert(key, value);
-    }
-    auto end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-    start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        auto key = rand(), value = rand();
-        STD_Map[key] = value;
-    }
-    end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-}
-
-
-TEST(PerformanceHashMapTest, DeleteTest) {
-    std::cout << "DeleteTest\n";
-    mtl::hash_map<int, int> MTL_MAP(5e6);
-    std::unordered_map<int, int> STD_Map(5e6);
-    auto start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        auto key = rand(), value = rand();
-        MTL_MAP.Insert(key, value);
-        if (i % 10 == 0) {
-            key = rand();
-            MTL_MAP.Delete(key);
-        }
-    }
-    auto end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-    start = std::chrono::steady_clock::now();
-    for (int i = 0; i < 1e6; ++i) {
-        auto key = rand(), value = rand();
-        STD_Map[key] = value;
-        if (i % 10 == 0) {
-            key = rand();
-            STD_Map.erase(key);
-        }
-    }
-    end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-}
-
 TEST(FunctionalHashMapTest, BigInsertTest) {
     mtl::hash_map<int, int> MTL_Map(5e6);
     std::unordered_map<int, int> STD_Map(5e6);
@@ -140,6 +78,191 @@ TEST(FunctionalHashMapTest, SimpleOperationsTest) {
     ASSERT_EQ(MTL_Map["hello"], 28);
     MTL_Map.Delete("hello");
     ASSERT_FALSE(MTL_Map.Contains("hello"));
+    ASSERT_THROW(MTL_Map["hello"], std::out_of_range);
+    ASSERT_THROW(MTL_Map["wrold"], std::out_of_range);
+}
+
+struct StoreHashPolicy : mtl::hash_policy {
+    static constexpr bool store_hash = true;
+};
+
+struct CountingHash {
+    static inline size_t calls = 0;
+
+    size_t operator()(const std::string& key) const {
+        ++calls;
+        return std::hash<std::string>()(key);
+    }
+};
+
+TEST(FunctionalHashMapTest, StoreHashTest) {
+    mtl::hash_map<std::string, int, std::allocator<std::pair<std::string, int>>, CountingHash, StoreHashPolicy> MTL_Map;
+    CountingHash::calls = 0;
+    for (int i = 0; i < 1e4; ++i) {
+        MTL_Map.Insert(std::to_string(i), i);
+    }
+    // growing the table must not hash the elements again
+    ASSERT_EQ(CountingHash::calls, 1e4);
+    for (int i = 0; i < 1e4; ++i) {
+        ASSERT_EQ(MTL_Map[std::to_string(i)], i);
+    }
+    MTL_Map.Delete("42");
+    ASSERT_FALSE(MTL_Map.Contains("42"));
+    ASSERT_EQ(MTL_Map.size(), 1e4 - 1);
+}
+
+template<typename Index>
+struct IndexPolicy : mtl::hash_policy {
+    using index = Index;
+};
+
+template<typename Index>
+void CheckIndexPolicy() {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, IndexPolicy<Index>> MTL_Map(100);
+    ASSERT_EQ(MTL_Map.capacity(), Index::Capacity(MTL_Map.capacity()));
+    // sequential and strided keys are the worst case for the identity std::hash<int>
+    for (int i = 0; i < 1e5; ++i) {
+        MTL_Map.Insert(i, i);
+        MTL_Map.Insert(-(i << 12) - 1, -i);
+    }
+    ASSERT_EQ(MTL_Map.capacity(), Index::Capacity(MTL_Map.capacity()));
+    ASSERT_EQ(MTL_Map.size(), 2e5);
+    for (int i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map[i], i);
+        ASSERT_EQ(MTL_Map[-(i << 12) - 1], -i);
+    }
+}
+
+TEST(FunctionalHashMapTest, IndexPolicyTest) {
+    CheckIndexPolicy<mtl::mask_index>();
+    CheckIndexPolicy<mtl::fastrange_index>();
+    CheckIndexPolicy<mtl::prime_index>();
+    ASSERT_EQ(mtl::mask_index::Capacity(100), 128);
+    ASSERT_EQ(mtl::prime_index::Capacity(100), 131);
+}
+
+TEST(FunctionalHashMapTest, RobinHoodTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, mtl::robin_hood_policy> MTL_Map;
+    std::unordered_map<int, int> STD_Map;
+    for (int i = 0; i < 1e6; ++i) {
+        auto key = rand() % 100000, value = rand();
+        STD_Map[key] = value;
+        MTL_Map.Insert(key, value);
+        key = rand() % 100000;
+        STD_Map.erase(key);
+        MTL_Map.Delete(key);
+    }
+    ASSERT_EQ(STD_Map.size(), MTL_Map.size());
+    for (auto j:STD_Map) {
+        ASSERT_EQ(j.second, MTL_Map[j.first]);
+    }
+    for (auto j:MTL_Map) {
+        ASSERT_EQ(j.second, STD_Map[j.first]);
+    }
+}
+
+struct IncrementalPolicy : mtl::hash_policy {
+    static constexpr size_t incremental_rehash = 8;
+};
+
+TEST(FunctionalHashMapTest, IncrementalRehashTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, IncrementalPolicy> MTL_Map;
+    std::unordered_map<int, int> STD_Map;
+    for (int i = 0; i < 1e5; ++i) {
+        auto key = rand() % 50000, value = rand();
+        STD_Map[key] = value;
+        MTL_Map.Insert(key, value);
+        key = rand() % 50000;
+        ASSERT_EQ(STD_Map.contains(key), MTL_Map.Contains(key));
+        if (STD_Map.contains(key)) {
+            ASSERT_EQ(STD_Map[key], MTL_Map[key]);
+        } else {
+            ASSERT_THROW(MTL_Map[key], std::out_of_range);
+        }
+        if (i % 3 == 0) {
+            STD_Map.erase(key);
+            MTL_Map.Delete(key);
+        }
+        ASSERT_EQ(STD_Map.size(), MTL_Map.size());
+    }
+    for (auto j:MTL_Map) {
+        ASSERT_EQ(j.second, STD_Map[j.first]);
+    }
+    for (auto j:STD_Map) {
+        ASSERT_EQ(j.second, MTL_Map[j.first]);
+    }
+}
+
+TEST(FunctionalHashMapTest, IncrementalLookupTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, IncrementalPolicy> MTL_Map;
+    int n = 0;
+    // stop right after a grow, so the migration is pending
+    for (auto capacity = MTL_Map.capacity(); MTL_Map.capacity() == capacity || n < 1000; ++n) {
+        capacity = MTL_Map.capacity();
+        MTL_Map.Insert(n, n);
+    }
+    std::vector<int*> values;
+    for (int i = 0; i < n; ++i) {
+        values.push_back(&MTL_Map[i]);
+        // lookups don't move elements, the references taken so far stay valid
+        ASSERT_TRUE(MTL_Map.Contains(i));
+    }
+    for (int i = 0; i < n; ++i) {
+        ASSERT_EQ(*values[i], i);
+    }
+}
+
+struct DenseIndexPolicy : mtl::hash_policy {
+    using index = mtl::fastrange_index;
+    static constexpr double max_load_factor = 0.875;
+    static constexpr double growth_factor = 1.5;
+};
+
+TEST(FunctionalHashMapTest, LoadFactorTest) {
+    mtl::hash_map<int, int> Sparse_Map(1e5);
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, DenseIndexPolicy> Dense_Map(1e5);
+    auto capacity = Dense_Map.capacity();
+    for (int i = 0; i < 1e5; ++i) {
+        Sparse_Map.Insert(i, i);
+        Dense_Map.Insert(i, i);
+    }
+    // the requested number of elements fits in without a grow
+    ASSERT_EQ(Dense_Map.capacity(), capacity);
+    ASSERT_LT(Dense_Map.capacity(), 1e5 / 0.8);
+    ASSERT_EQ(Dense_Map.memory_usage(),
+              Dense_Map.capacity() * (sizeof(std::pair<int, int>) + 1) + mtl::detail::Group::kWidth);
+    ASSERT_LT(Dense_Map.memory_usage() * 2, Sparse_Map.memory_usage());
+    Dense_Map.Insert(-1, -1);
+    ASSERT_EQ(Dense_Map.capacity(), capacity * 3 / 2);
+    for (int i = -1; i < 1e5; ++i) {
+        ASSERT_EQ(Dense_Map[i], i);
+    }
+}
+
+TEST(FunctionalHashMapTest, TransparentLookupTest) {
+    mtl::hash_map<std::string, int, std::allocator<std::pair<std::string, int>>, mtl::string_hash> MTL_Map;
+    MTL_Map.Insert("hello", 20);
+    MTL_Map.Insert("world", 45);
+    std::string buffer = "say hello world";
+    std::string_view hello(buffer.data() + 4, 5);
+    ASSERT_TRUE(MTL_Map.Contains(hello));
+    ASSERT_FALSE(MTL_Map.Contains(std::string_view(buffer.data(), 3)));
+    ASSERT_EQ(MTL_Map[hello], 20);
+    ASSERT_EQ(MTL_Map["world"], 45);
+    MTL_Map.Delete(std::string_view(buffer).substr(10));
+    ASSERT_FALSE(MTL_Map.Contains("world"));
+    ASSERT_EQ(MTL_Map.size(), 1);
+
+    mtl::hash_set<std::string, std::allocator<std::string>, mtl::string_hash> MTL_Set;
+    MTL_Set.Insert("hello");
+    ASSERT_TRUE(MTL_Set.Contains(hello));
+    MTL_Set.Delete(hello);
+    ASSERT_FALSE(MTL_Set.Contains("hello"));
+
+    mtl::hash_multiset<std::string, std::allocator<std::pair<std::string, int32_t>>, mtl::string_hash> MTL_MultiSet;
+    MTL_MultiSet.Insert("hello");
+    MTL_MultiSet.Insert("hello");
+    ASSERT_EQ(MTL_MultiSet.Count(hello), 2);
 }
 
 TEST(FunctionalHashSetTest, BigContainsTest) {
@@ -179,6 +302,62 @@ TEST(FunctionalHashSetTest, BigDeleteTest) {
     }
 }
 
+TEST(FunctionalHashSetTest, ChurnTest) {
+    mtl::hash_set<int> MTL_Set(64);
+    for (int i = 0; i < 1e6; ++i) {
+        MTL_Set.Insert(i);
+        if (i >= 50) {
+            MTL_Set.Delete(i - 50);
+        }
+    }
+    ASSERT_EQ(MTL_Set.size(), 50);
+    ASSERT_LE(MTL_Set.capacity(), 1024);
+    for (int i = 1e6 - 50; i < 1e6; ++i) {
+        ASSERT_TRUE(MTL_Set.Contains(i));
+    }
+    ASSERT_FALSE(MTL_Set.Contains(1e6 - 51));
+}
+
+TEST(FunctionalHashSetTest, ReserveShrinkTest) {
+    mtl::hash_set<int> MTL_Set;
+    MTL_Set.reserve(1e5);
+    auto capacity = MTL_Set.capacity();
+    for (int i = 0; i < 1e5; ++i) {
+        MTL_Set.Insert(i);
+    }
+    ASSERT_EQ(MTL_Set.capacity(), capacity);
+    for (int i = 10; i < 1e5; ++i) {
+        MTL_Set.Delete(i);
+    }
+    MTL_Set.shrink_to_fit();
+    ASSERT_LE(MTL_Set.capacity(), 32);
+    ASSERT_EQ(MTL_Set.size(), 10);
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_EQ(MTL_Set.Contains(i), i < 10);
+    }
+}
+
+TEST(FunctionalHashMapTest, DropTombstonesTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, StoreHashPolicy> MTL_Map(1000);
+    std::unordered_map<int, int> STD_Map;
+    auto capacity = MTL_Map.capacity();
+    for (int i = 0; i < 1e6; ++i) {
+        auto key = rand(), value = rand();
+        MTL_Map.Insert(key, value);
+        STD_Map[key] = value;
+        if (STD_Map.size() > 200) {
+            MTL_Map.Delete(STD_Map.begin()->first);
+            STD_Map.erase(STD_Map.begin());
+        }
+    }
+    // the tombstones are reclaimed inside the same arrays
+    ASSERT_EQ(MTL_Map.capacity(), capacity);
+    ASSERT_EQ(MTL_Map.size(), STD_Map.size());
+    for (auto j:STD_Map) {
+        ASSERT_EQ(j.second, MTL_Map[j.first]);
+    }
+}
+
 TEST(FunctionalHashSetTest, SimpleOperationsTest) {
     mtl::hash_set<std::string> MTL_Set;
     MTL_Set.Insert("hello");
@@ -195,6 +374,20 @@ TEST(FunctionalHashSetTest, SimpleOperationsTest) {
     ASSERT_FALSE(MTL_Set.Contains("hello"));
 }
 
+TEST(FunctionalHashSetTest, RobinHoodTest) {
+    mtl::hash_set<std::string, std::allocator<std::string>, std::hash<std::string>, mtl::robin_hood_policy> MTL_Set;
+    for (int i = 0; i < 1e5; ++i) {
+        MTL_Set.Insert(std::to_string(i));
+    }
+    for (int i = 0; i < 1e5; i += 2) {
+        MTL_Set.Delete(std::to_string(i));
+    }
+    ASSERT_EQ(MTL_Set.size(), 5e4);
+    for (int i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Set.Contains(std::to_string(i)), i % 2 == 1);
+    }
+}
+
 TEST(FunctionalHashMultiSetTest, BigContainsTest) {
     mtl::hash_multiset<std::string> MTL_Set(5e6);
     std::unordered_multiset<std::string> STD_Set(5e6);
@@ -245,6 +438,17 @@ TEST(FunctionalHashMultiSetTest, SimpleOperationsTest) {
     ASSERT_FALSE(MTL_Set.Contains("hello"));
 }
 
+TEST(FunctionalHashMultiSetTest, RobinHoodTest) {
+    mtl::hash_multiset<int, std::allocator<std::pair<int, int32_t>>, std::hash<int>, mtl::robin_hood_policy> MTL_Set;
+    for (int i = 0; i < 1e5; ++i) {
+        MTL_Set.Insert(i % 1000);
+    }
+    MTL_Set.Delete(7);
+    ASSERT_EQ(MTL_Set.size(), 999);
+    ASSERT_EQ(MTL_Set.Count(7), 0);
+    ASSERT_EQ(MTL_Set.Count(8), 100);
+}
+
 TEST(IteratorHashMapTest, DecrementTest) {
     mtl::hash_map<std::string, int> MTL_Map;
     MTL_Map.Insert("hello", 20);
@@ -303,29 +507,1067 @@ TEST(FunctionalHashMapTest, NoCopyConstructorTest) {
     ASSERT_FALSE(MTL_Map.Contains("hello"));
 }
 
-TEST(PerformanceHashMapTest, NoCopyConstructorTest) {
-    std::cout << "InsertTest\n";
-    mtl::hash_map<int, Foo> MTL_MAP(5e6);
-    std::unordered_map<int, Foo> STD_Map(5e6);
-    std::vector<std::pair<int, Foo>> tests_std;
-    std::vector<std::pair<int, Foo>> tests_mtl;
+class Counted {
+public:
+    static inline int64_t alive = 0;
+    static inline int64_t copies = 0;
+
+    explicit Counted(int value) : value(value) { ++alive; }
+
+    Counted(const Counted& other) : value(other.value) {
+        ++alive;
+        ++copies;
+    }
+
+    Counted(Counted&& other) noexcept: value(other.value) { ++alive; }
+
+    Counted& operator=(const Counted& other) = default;
+
+    Counted& operator=(Counted&& other) noexcept = default;
+
+    ~Counted() { --alive; }
+
+    bool operator==(const Counted& other) const { return value == other.value; }
+
+    int value;
+};
+
+struct CountedHash {
+    size_t operator()(const Counted& key) const { return std::hash<int>()(key.value); }
+};
+
+TEST(FunctionalHashMapTest, LazyConstructionTest) {
+    Counted::alive = 0;
+    {
+        mtl::hash_map<int, Counted> MTL_Map(1000);
+        ASSERT_EQ(Counted::alive, 0);
+        for (int i = 0; i < 1e4; ++i) {
+            MTL_Map.Insert(i, Counted(i));
+        }
+        ASSERT_EQ(Counted::alive, 1e4);
+        for (int i = 0; i < 1e4; i += 2) {
+            MTL_Map.Delete(i);
+        }
+        ASSERT_EQ(Counted::alive, 5e3);
+        ASSERT_EQ(MTL_Map[1].value, 1);
+    }
+    ASSERT_EQ(Counted::alive, 0);
+    {
+        mtl::hash_map<int, Counted, std::allocator<std::pair<int, Counted>>, std::hash<int>, mtl::robin_hood_policy> MTL_Map;
+        for (int i = 0; i < 1e4; ++i) {
+            MTL_Map.Insert(i, Counted(i));
+        }
+        for (int i = 0; i < 1e4; i += 2) {
+            MTL_Map.Delete(i);
+        }
+        ASSERT_EQ(Counted::alive, 5e3);
+    }
+    ASSERT_EQ(Counted::alive, 0);
+}
+
+template<typename Policy>
+void CheckEmplace() {
+    Counted::alive = 0;
+    {
+        mtl::hash_map<int, Counted, std::allocator<std::pair<int, Counted>>, std::hash<int>, Policy> MTL_Map;
+        for (int i = 0; i < 1e4; ++i) {
+            auto [it, inserted] = MTL_Map.TryEmplace(i, i);
+            ASSERT_TRUE(inserted);
+            ASSERT_EQ(it->first, i);
+            ASSERT_EQ(it->second.value, i);
+        }
+        ASSERT_EQ(Counted::alive, 1e4);
+        // nothing is constructed for the keys already present
+        for (int i = 0; i < 1e4; ++i) {
+            auto [it, inserted] = MTL_Map.TryEmplace(i, -1);
+            ASSERT_FALSE(inserted);
+            ASSERT_EQ(it->second.value, i);
+        }
+        ASSERT_EQ(Counted::alive, 1e4);
+        for (int i = 0; i < 1e4; ++i) {
+            ASSERT_FALSE(MTL_Map.InsertOrAssign(i, Counted(-i)).second);
+        }
+        // the argument refers to an element of the table while it grows
+        for (int i = 1e4; i < 2e4; ++i) {
+            ASSERT_TRUE(MTL_Map.InsertOrAssign(i, MTL_Map[i - 1e4]).second);
+        }
+        ASSERT_TRUE(MTL_Map.Emplace(-1, Counted(7)).second);
+        ASSERT_FALSE(MTL_Map.Emplace(-1, Counted(8)).second);
+        ASSERT_EQ(MTL_Map.size(), 2e4 + 1);
+        ASSERT_EQ(Counted::alive, 2e4 + 1);
+        for (int i = 0; i < 2e4; ++i) {
+            ASSERT_EQ(MTL_Map[i].value, -(i % 10000));
+        }
+        ASSERT_EQ(MTL_Map[-1].value, 7);
+    }
+    ASSERT_EQ(Counted::alive, 0);
+    // the pair built by Emplace is moved into the slot, its key is never copied
+    Counted::copies = 0;
+    {
+        mtl::hash_map<Counted, int, std::allocator<std::pair<Counted, int>>, CountedHash, Policy> MTL_Map;
+        for (int i = 0; i < 1e4; ++i) {
+            ASSERT_TRUE(MTL_Map.Emplace(Counted(i), i).second);
+        }
+        ASSERT_FALSE(MTL_Map.Emplace(Counted(7), -7).second);
+        ASSERT_EQ(MTL_Map[Counted(7)], 7);
+        mtl::hash_set<Counted, std::allocator<Counted>, CountedHash, Policy> MTL_Set;
+        for (int i = 0; i < 1e4; ++i) {
+            ASSERT_TRUE(MTL_Set.Emplace(i).second);
+        }
+    }
+    ASSERT_EQ(Counted::copies, 0);
+    ASSERT_EQ(Counted::alive, 0);
+}
+
+TEST(FunctionalHashMapTest, EmplaceTest) {
+    CheckEmplace<mtl::hash_policy>();
+    CheckEmplace<mtl::robin_hood_policy>();
+    CheckEmplace<IncrementalPolicy>();
+}
+
+TEST(FunctionalHashMapTest, FindOrInsertTest) {
+    mtl::hash_map<std::string, int> MTL_Map;
+    for (int i = 0; i < 1e4; ++i) {
+        ++MTL_Map.FindOrInsert(std::to_string(i % 100));
+    }
+    ASSERT_EQ(MTL_Map.size(), 100);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(MTL_Map[std::to_string(i)], 100);
+    }
+    mtl::hash_set<std::string> MTL_Set;
+    ASSERT_TRUE(MTL_Set.Emplace(3, 'a').second);
+    ASSERT_FALSE(MTL_Set.Emplace("aaa").second);
+    ASSERT_EQ(MTL_Set.FindOrInsert("b"), "b");
+    ASSERT_EQ(MTL_Set.size(), 2);
+}
+
+template<typename Policy>
+void CheckBatch() {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, Policy> MTL_Map;
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < 1e4; ++i) {
+        pairs.emplace_back(i, i);
+        pairs.emplace_back(i / 2, -i);
+    }
+    MTL_Map.InsertBatch(pairs);
+    ASSERT_EQ(MTL_Map.size(), 1e4);
+    std::vector<int> keys;
+    for (int i = -1e4; i < 2e4; ++i) {
+        keys.push_back(i);
+    }
+    std::vector<int*> values(keys.size());
+    std::unique_ptr<bool[]> contains(new bool[keys.size()]);
+    MTL_Map.FindBatch(keys, values);
+    MTL_Map.ContainsBatch(keys, std::span(contains.get(), keys.size()));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto key = keys[i];
+        ASSERT_EQ(contains[i], key >= 0 && key < 1e4);
+        if (!contains[i]) {
+            ASSERT_EQ(values[i], nullptr);
+        } else if (key < 5e3) {
+            ASSERT_EQ(*values[i], -(2 * key + 1));
+        } else {
+            ASSERT_EQ(*values[i], key);
+        }
+    }
+}
+
+TEST(FunctionalHashMapTest, BatchTest) {
+    CheckBatch<mtl::hash_policy>();
+    CheckBatch<mtl::robin_hood_policy>();
+    CheckBatch<IncrementalPolicy>();
+    CheckBatch<StoreHashPolicy>();
+
+    mtl::hash_multiset<int> MTL_Multiset;
+    std::vector<int> values;
+    for (int i = 0; i < 1e4; ++i) {
+        values.push_back(i % 100);
+    }
+    MTL_Multiset.InsertBatch(values);
+    std::vector<int32_t> counts(values.size());
+    MTL_Multiset.CountBatch(values, counts);
+    for (auto count: counts) {
+        ASSERT_EQ(count, 100);
+    }
+
+    // random keys over a table that is far out of the cache, the batches agree with the one-by-one operations
+    mtl::hash_map<int, int> Batch_Map;
+    std::unordered_map<int, int> STD_Map;
+    std::vector<std::pair<int, int>> pairs;
     for (int i = 0; i < 1e6; ++i) {
-        int key = rand();
-        int value = rand();
-        tests_std.emplace_back(key, std::to_string(value));
-        tests_mtl.emplace_back(key, std::to_string(value));
+        pairs.emplace_back(rand(), i);
+        STD_Map[pairs.back().first] = i;
     }
-    auto start = std::chrono::steady_clock::now();
+    Batch_Map.InsertBatch(pairs);
+    ASSERT_EQ(Batch_Map.size(), STD_Map.size());
+    std::vector<int> keys;
     for (int i = 0; i < 1e6; ++i) {
-        MTL_MAP.Insert(tests_mtl[i].first, std::move(tests_mtl[i].second));
+        keys.push_back(i % 2 ? rand() : pairs[i].first);
     }
-    auto end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
-    start = std::chrono::steady_clock::now();
+    std::vector<int*> found(keys.size());
+    std::unique_ptr<bool[]> contains(new bool[keys.size()]);
+    Batch_Map.FindBatch(keys, found);
+    Batch_Map.ContainsBatch(keys, std::span(contains.get(), keys.size()));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(contains[i], Batch_Map.Contains(keys[i]));
+        ASSERT_EQ(contains[i], STD_Map.contains(keys[i]));
+        ASSERT_EQ(found[i] == nullptr, !contains[i]);
+        if (found[i]) {
+            ASSERT_EQ(*found[i], STD_Map[keys[i]]);
+        }
+    }
+}
+
+TEST(FunctionalHashMapTest, IncrementalBatchTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, IncrementalPolicy> MTL_Map;
+    std::vector<int> keys;
+    // every round grows the map, so each batch starts with a pending migration
+    for (int round = 0; round < 8; ++round) {
+        auto capacity = MTL_Map.capacity();
+        for (int i = static_cast<int>(keys.size()); MTL_Map.capacity() == capacity; ++i) {
+            MTL_Map.Insert(i, i);
+            keys.push_back(i);
+        }
+        std::vector<int*> values(keys.size());
+        MTL_Map.FindBatch(keys, values);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            ASSERT_NE(values[i], nullptr);
+            ASSERT_EQ(*values[i], keys[i]);
+        }
+    }
+}
+
+template<typename Policy>
+void CheckBuildParallel() {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, Policy> MTL_Map;
+    MTL_Map.Insert(-1, -1);
+    MTL_Map.Insert(-2, -2);
+    MTL_Map.Delete(-2);
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < 1e5; ++i) {
+        pairs.emplace_back(i, i);
+        // equal keys keep the last value like Insert
+        pairs.emplace_back(i / 4, -i);
+    }
+    MTL_Map.BuildParallel(pairs, 4);
+    ASSERT_EQ(MTL_Map.size(), 1e5 + 1);
+    for (int i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map[i], i < 25000 ? -(4 * i + 3) : i);
+    }
+    ASSERT_EQ(MTL_Map[-1], -1);
+    ASSERT_FALSE(MTL_Map.Contains(-2));
+    MTL_Map.reserve(1e6, 3);
+    ASSERT_EQ(MTL_Map.size(), 1e5 + 1);
+    for (int i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map[i], i < 25000 ? -(4 * i + 3) : i);
+    }
+    size_t count = 0;
+    for ([[maybe_unused]] auto& pair: MTL_Map) {
+        ++count;
+    }
+    ASSERT_EQ(count, 1e5 + 1);
+
+    // the deletes of a sparse table leave empty slots, not tombstones, in front of the keys that share their home
+    // slots; the bulk insertion into the same arrays has to find those keys behind them
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, Policy> Sparse_Map(1000);
+    for (int i = 0; i < 400; ++i) {
+        Sparse_Map.Insert(i, i);
+    }
+    auto capacity = Sparse_Map.capacity();
+    pairs.clear();
+    for (int i = 0; i < 400; ++i) {
+        if (i % 2 == 0) {
+            Sparse_Map.Delete(i);
+        } else {
+            pairs.emplace_back(i, -i);
+        }
+    }
+    Sparse_Map.BuildParallel(pairs, 4);
+    ASSERT_EQ(Sparse_Map.capacity(), capacity);
+    ASSERT_EQ(Sparse_Map.size(), 200);
+    count = 0;
+    for (auto& [key, value]: Sparse_Map) {
+        ASSERT_EQ(value, -key);
+        ++count;
+    }
+    ASSERT_EQ(count, 200);
+    for (int i = 1; i < 400; i += 2) {
+        Sparse_Map.Delete(i);
+        ASSERT_FALSE(Sparse_Map.Contains(i));
+    }
+    ASSERT_EQ(Sparse_Map.size(), 0);
+}
+
+TEST(FunctionalHashMapTest, BuildParallelTest) {
+    CheckBuildParallel<mtl::hash_policy>();
+    CheckBuildParallel<mtl::robin_hood_policy>();
+    CheckBuildParallel<IncrementalPolicy>();
+    CheckBuildParallel<StoreHashPolicy>();
+    CheckBuildParallel<IndexPolicy<mtl::prime_index>>();
+
+    mtl::hash_set<std::string> MTL_Set;
+    std::vector<std::string> values;
+    for (int i = 0; i < 1e4; ++i) {
+        values.push_back(std::to_string(i % 5000));
+    }
+    MTL_Set.BuildParallel(values, 8);
+    ASSERT_EQ(MTL_Set.size(), 5000);
+    for (int i = 0; i < 5000; ++i) {
+        ASSERT_TRUE(MTL_Set.Contains(std::to_string(i)));
+    }
+}
+
+template<typename Policy>
+void CheckSnapshot() {
+    using Map = mtl::hash_map<uint64_t, std::array<int, 3>, std::allocator<std::pair<uint64_t, std::array<int, 3>>>,
+            std::hash<uint64_t>, Policy>;
+    auto path = testing::TempDir() + "mtl_snapshot";
+    {
+        Map MTL_Map;
+        for (uint64_t i = 0; i < 1e5; ++i) {
+            MTL_Map.Insert(i * 7, {int(i), -int(i), 1});
+        }
+        for (uint64_t i = 0; i < 1e5; i += 3) {
+            MTL_Map.Delete(i * 7);
+        }
+        ASSERT_TRUE(MTL_Map.Save(path.c_str()));
+    }
+    Map MTL_Map;
+    MTL_Map.Insert(1, {1, 1, 1});
+    ASSERT_TRUE(MTL_Map.MapFromFile(path.c_str()));
+    ASSERT_FALSE(MTL_Map.Contains(1));
+    ASSERT_EQ(MTL_Map.size(), 1e5 - 33334);
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map.Contains(i * 7), i % 3 != 0);
+        if (i % 3 != 0) {
+            ASSERT_EQ(MTL_Map[i * 7][1], -int(i));
+        }
+    }
+    // the mapping is copy-on-write, the table keeps working after it
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        MTL_Map.Insert(i * 7 + 1, {0, 0, 0});
+    }
+    ASSERT_EQ(MTL_Map.size(), 2e5 - 33334);
+    ASSERT_EQ(MTL_Map[7][0], 1);
+
+    mtl::hash_map<uint64_t, int> Other_Map;
+    ASSERT_FALSE(Other_Map.MapFromFile(path.c_str()));
+    ASSERT_FALSE(Other_Map.MapFromFile((path + "_missing").c_str()));
+    std::remove(path.c_str());
+}
+
+TEST(FunctionalHashMapTest, SnapshotTest) {
+    CheckSnapshot<mtl::hash_policy>();
+    CheckSnapshot<StoreHashPolicy>();
+    CheckSnapshot<mtl::robin_hood_policy>();
+}
+
+TEST(FunctionalConcurrentHashMapTest, UpsertTest) {
+    mtl::concurrent_hash_map<int, int64_t> MTL_Map;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&MTL_Map, t] {
+            for (int i = 0; i < 1e5; ++i) {
+                MTL_Map.Upsert(i % 1000, 1, [](int64_t& count) { ++count; });
+                if (i % 10 == 0) {
+                    MTL_Map.Insert(-t * 100000 - i - 1, i);
+                    ASSERT_TRUE(MTL_Map.Contains(-t * 100000 - i - 1));
+                    ASSERT_TRUE(MTL_Map.Delete(-t * 100000 - i - 1));
+                }
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    ASSERT_EQ(MTL_Map.size(), 1000);
+    int64_t total = 0;
+    MTL_Map.ForEach([&total](int, int64_t count) {
+        ASSERT_EQ(count, 800);
+        total += count;
+    });
+    ASSERT_EQ(total, 8e5);
+    ASSERT_TRUE(MTL_Map.ComputeIfPresent(7, [](int64_t& count) { count = -1; }));
+    ASSERT_FALSE(MTL_Map.ComputeIfPresent(-7, [](int64_t& count) { count = -1; }));
+    ASSERT_EQ(MTL_Map.Get(7), -1);
+    ASSERT_EQ(MTL_Map.Get(-7), std::nullopt);
+    ASSERT_FALSE(MTL_Map.TryEmplace(7, 5));
+}
+
+TEST(FunctionalConcurrentHashMapTest, InsertTest) {
+    mtl::concurrent_hash_map<int, int> MTL_Map;
+    std::vector<std::thread> threads;
+    std::atomic<int> inserted = 0;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&MTL_Map, &inserted, t] {
+            // every key is inserted by two threads, exactly one of them inserts it
+            for (int i = 0; i < 1e5; ++i) {
+                auto key = (t / 2) * 100000 + i;
+                inserted += MTL_Map.Insert(key, key);
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    ASSERT_EQ(inserted, 4e5);
+    ASSERT_EQ(MTL_Map.size(), 4e5);
+    for (int key = 0; key < 4e5; ++key) {
+        ASSERT_EQ(MTL_Map.Get(key), key);
+    }
+    ASSERT_FALSE(MTL_Map.Contains(-1));
+}
+
+TEST(FunctionalReadMostlyHashMapTest, ConcurrentReadTest) {
+    mtl::read_mostly_hash_map<int, std::string> MTL_Map;
+    for (int i = 0; i < 1000; ++i) {
+        MTL_Map.Insert(i, std::to_string(i));
+    }
+    std::atomic<bool> done = false;
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&MTL_Map, &done] {
+            while (!done.load()) {
+                for (int i = 0; i < 1000; ++i) {
+                    // the writer only changes the values of the keys above 1000
+                    auto value = MTL_Map.Get(i);
+                    ASSERT_TRUE(value.has_value());
+                    ASSERT_EQ(*value, std::to_string(i));
+                    MTL_Map.Visit(i + 1000, [i](const std::string& value) {
+                        ASSERT_TRUE(value == std::to_string(i) || value == std::to_string(-i));
+                    });
+                }
+            }
+        });
+    }
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            ASSERT_EQ(MTL_Map.Insert(i + 1000, std::to_string(round % 2 ? i : -i)), round == 0);
+        }
+        for (int i = 0; i < 1000; i += 2) {
+            ASSERT_TRUE(MTL_Map.Delete(i + 1000));
+            ASSERT_TRUE(MTL_Map.Insert(i + 1000, std::to_string(i)));
+        }
+    }
+    for (int i = 2000; i < 1e5; ++i) {
+        MTL_Map.Insert(i, std::to_string(i));
+    }
+    done = true;
+    for (auto& thread: readers) {
+        thread.join();
+    }
+    ASSERT_EQ(MTL_Map.size(), 1e5);
+    ASSERT_FALSE(MTL_Map.Delete(-1));
+    ASSERT_FALSE(MTL_Map.Contains(-1));
+    ASSERT_TRUE(MTL_Map.Contains(99999));
+}
+
+TEST(FunctionalFrozenMapTest, FromHashMapTest) {
+    mtl::hash_map<uint64_t, int> MTL_Map;
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        MTL_Map.Insert(i * 13, int(i));
+    }
+    mtl::frozen_map<uint64_t, int> Frozen_Map(MTL_Map);
+    ASSERT_EQ(Frozen_Map.size(), MTL_Map.size());
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(*Frozen_Map.Find(i * 13), int(i));
+        ASSERT_FALSE(Frozen_Map.Contains(i * 13 + 1));
+    }
+    size_t count = 0;
+    for (auto& [key, value]: Frozen_Map) {
+        ASSERT_EQ(MTL_Map[key], value);
+        ++count;
+    }
+    ASSERT_EQ(count, 1e5);
+
+    mtl::hash_set<std::string> MTL_Set;
+    for (int i = 0; i < 1000; ++i) {
+        MTL_Set.Insert(std::to_string(i));
+    }
+    mtl::frozen_set<std::string> Frozen_Set(MTL_Set);
+    for (int i = 0; i < 2000; ++i) {
+        ASSERT_EQ(Frozen_Set.Contains(std::to_string(i)), i < 1000);
+    }
+    ASSERT_TRUE(Frozen_Set.Contains(std::string_view("999")));
+    ASSERT_FALSE(mtl::frozen_set<int>(std::vector<int>()).Contains(0));
+}
+
+TEST(FunctionalFrozenMapTest, ConstexprTest) {
+    static constexpr auto Frozen_Map = mtl::make_frozen_map<std::string_view, int>({
+            {"GET", 1}, {"PUT", 2}, {"POST", 3}, {"HEAD", 4}, {"DELETE", 5}, {"OPTIONS", 6}, {"PATCH", 7}});
+    static_assert(Frozen_Map.size() == 7);
+    static_assert(Frozen_Map["POST"] == 3);
+    static_assert(*Frozen_Map.Find("PATCH") == 7);
+    static_assert(Frozen_Map.Find("TRACE") == nullptr);
+    static constexpr auto Frozen_Set = mtl::make_frozen_set<int>({2, 3, 5, 7, 11, 13, 17, 19});
+    static_assert(Frozen_Set.Contains(13) && !Frozen_Set.Contains(12));
+    ASSERT_EQ(Frozen_Map["DELETE"], 5);
+    ASSERT_FALSE(Frozen_Set.Contains(4));
+}
+
+TEST(FunctionalHashMapTest, HugePageAllocatorTest) {
+    using Alloc = mtl::huge_page_allocator<std::pair<uint64_t, uint64_t>>;
+    mtl::huge_page_options options;
+    options.threshold = 1 << 16;
+    options.prefault_threads = 2;
+    options.numa = mtl::numa_policy::interleave;
+    options.nodes = 1;
+    mtl::hash_map<uint64_t, uint64_t, Alloc> MTL_Map(1, Alloc(options));
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        MTL_Map.Insert(i, i * 3);
+    }
+    for (uint64_t i = 0; i < 1e5; i += 2) {
+        MTL_Map.Delete(i);
+    }
+    MTL_Map.shrink_to_fit();
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map.Contains(i), i % 2 == 1);
+    }
+    ASSERT_EQ(MTL_Map[99999], 299997);
+
+    // the large arrays are aligned to huge pages, the small ones come from std::allocator
+    Alloc alloc(options);
+    auto large = alloc.allocate(1 << 20), small = alloc.allocate(16);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(large) % (1 << 21), 0);
+    large[(1 << 20) - 1].second = 1;
+    alloc.deallocate(large, 1 << 20);
+    alloc.deallocate(small, 16);
+    ASSERT_TRUE(alloc == mtl::huge_page_allocator<int8_t>(alloc));
+
+    mtl::hash_set<int, mtl::huge_page_allocator<int>> MTL_Set;
+    mtl::hash_multiset<int, mtl::huge_page_allocator<std::pair<int, int32_t>>> MTL_MultiSet;
     for (int i = 0; i < 1e6; ++i) {
-        STD_Map[tests_std[i].first] = Foo(std::move(tests_std[i].second));
+        MTL_Set.Insert(i);
+        MTL_MultiSet.Insert(i % 1000);
+    }
+    ASSERT_EQ(MTL_Set.size(), 1e6);
+    ASSERT_EQ(MTL_MultiSet.Count(7), 1000);
+}
+
+// every TYPED_TEST of the suite runs over each table layout
+template<typename Policy>
+class FunctionalPolicyTest : public testing::Test {
+};
+
+using Policies = testing::Types<mtl::hash_policy, StoreHashPolicy, mtl::robin_hood_policy, IncrementalPolicy,
+        IndexPolicy<mtl::fastrange_index>, IndexPolicy<mtl::prime_index>>;
+
+TYPED_TEST_SUITE(FunctionalPolicyTest, Policies);
+
+template<typename Base>
+struct StatsPolicy : Base {
+    static constexpr bool collect_stats = true;
+};
+
+TYPED_TEST(FunctionalPolicyTest, StatsTest) {
+    mtl::hash_map<int, int, std::allocator<std::pair<int, int>>, std::hash<int>, StatsPolicy<TypeParam>> MTL_Map;
+    for (int i = 0; i < 1e4; ++i) {
+        MTL_Map.Insert(i, i);
+    }
+    for (int i = 0; i < 2e4; ++i) {
+        MTL_Map.Contains(i);
+    }
+    for (int i = 0; i < 1e4; i += 2) {
+        MTL_Map.Delete(i);
+    }
+    auto stats = MTL_Map.stats();
+    uint64_t hits = 0, misses = 0;
+    for (size_t i = 0; i < mtl::hash_stats::kProbeBuckets; ++i) {
+        hits += stats.hit_probes[i];
+        misses += stats.miss_probes[i];
+    }
+    // the inserts miss, then every Contains and Delete; a key still in the old arrays of an incremental
+    // rehash is a miss of the new ones
+    ASSERT_EQ(hits + misses, 1e4 + 5e3 + 1e4 + 1e4);
+    if constexpr (TypeParam::incremental_rehash == 0) {
+        ASSERT_EQ(hits, 1e4 + 5e3);
+    }
+    ASSERT_GE(stats.max_probe, 1);
+    ASSERT_GT(stats.rehashes, 0);
+    ASSERT_EQ(stats.occupied, MTL_Map.size());
+    ASSERT_EQ(stats.occupied + stats.tombstones + stats.empty, MTL_Map.capacity());
+    if constexpr (TypeParam::robin_hood) {
+        ASSERT_EQ(stats.tombstones, 0);
+    }
+
+    auto path = testing::TempDir() + "mtl_stats";
+    auto out = std::fopen(path.c_str(), "w");
+    stats.Dump(out);
+    std::fclose(out);
+    std::string text(4096, '\0');
+    out = std::fopen(path.c_str(), "r");
+    text.resize(std::fread(text.data(), 1, text.size(), out));
+    std::fclose(out);
+    std::remove(path.c_str());
+    ASSERT_NE(text.find("mtl_hash_hit_probes{length=\"1\"} " + std::to_string(stats.hit_probes[0]) + "\n"),
+              std::string::npos);
+    ASSERT_NE(text.find("mtl_hash_occupied_slots 5000\n"), std::string::npos);
+}
+
+TEST(FunctionalSentinelHashMapTest, RandomOperationsTest) {
+    mtl::sentinel_hash_map<int, std::string, -1, -2> MTL_Map;
+    std::unordered_map<int, std::string> STD_Map;
+    std::mt19937 random(7);
+    for (int i = 0; i < 3e5; ++i) {
+        int key = static_cast<int>(random() % 20000);
+        switch (random() % 4) {
+            case 0:
+                ASSERT_EQ(MTL_Map.Delete(key), STD_Map.erase(key) == 1);
+                break;
+            case 1:
+                ASSERT_EQ(MTL_Map.Contains(key), STD_Map.contains(key));
+                break;
+            default:
+                MTL_Map.Insert(key, std::to_string(i));
+                STD_Map[key] = std::to_string(i);
+        }
+    }
+    ASSERT_EQ(MTL_Map.size(), STD_Map.size());
+    size_t count = 0;
+    for (auto& [key, value]: MTL_Map) {
+        ASSERT_EQ(STD_Map[key], value);
+        ++count;
+    }
+    ASSERT_EQ(count, STD_Map.size());
+    ASSERT_FALSE(MTL_Map.Contains(-1));
+    ASSERT_FALSE(MTL_Map.Delete(-2));
+    ASSERT_THROW(MTL_Map.Insert(-1, ""), std::invalid_argument);
+    MTL_Map.shrink_to_fit();
+    ASSERT_EQ(*MTL_Map.TryFind(STD_Map.begin()->first), STD_Map.begin()->second);
+    ASSERT_EQ(MTL_Map.TryFind(30000), nullptr);
+
+    mtl::sentinel_hash_set<uint64_t> MTL_Set;
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        ASSERT_TRUE(MTL_Set.Insert(i * 3));
+    }
+    ASSERT_FALSE(MTL_Set.Insert(3));
+    for (uint64_t i = 0; i < 3e5; ++i) {
+        ASSERT_EQ(MTL_Set.Contains(i), i % 3 == 0);
+    }
+    // no control bytes: only the slots are allocated
+    mtl::hash_set<uint64_t> Other_Set;
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        Other_Set.Insert(i * 3);
+    }
+    ASSERT_EQ(MTL_Set.memory_usage(), MTL_Set.capacity() * sizeof(uint64_t));
+    ASSERT_LT(MTL_Set.memory_usage(), Other_Set.memory_usage());
+
+    // enum keys name their sentinels, every enumerator can be inserted
+    enum class Color : uint8_t { Red, Green, Blue, Empty = 254, Deleted = 255 };
+    mtl::sentinel_hash_set<Color, Color::Empty, Color::Deleted> Color_Set;
+    ASSERT_TRUE(Color_Set.Insert(Color::Red));
+    ASSERT_TRUE(Color_Set.Insert(Color::Blue));
+    ASSERT_TRUE(Color_Set.Contains(Color::Red));
+    ASSERT_FALSE(Color_Set.Contains(Color::Green));
+    ASSERT_THROW(Color_Set.Insert(Color::Empty), std::invalid_argument);
+
+    // a move allocates nothing, the moved-from table is empty and allocates again on its first insert
+    static_assert(std::is_nothrow_move_constructible_v<decltype(MTL_Map)>);
+    static_assert(std::is_nothrow_move_assignable_v<decltype(MTL_Map)>);
+    auto Moved_Map = std::move(MTL_Map);
+    ASSERT_EQ(Moved_Map.size(), STD_Map.size());
+    ASSERT_EQ(MTL_Map.size(), 0);
+    ASSERT_EQ(MTL_Map.memory_usage(), 0);
+    ASSERT_FALSE(MTL_Map.Contains(STD_Map.begin()->first));
+    ASSERT_EQ(MTL_Map.TryFind(1), nullptr);
+    ASSERT_FALSE(MTL_Map.Delete(1));
+    ASSERT_EQ(MTL_Map.begin(), MTL_Map.end());
+    MTL_Map.shrink_to_fit();
+    MTL_Map.Insert(1, "one");
+    Moved_Map = std::move(MTL_Map);
+    ASSERT_EQ(Moved_Map.size(), 1);
+    ASSERT_EQ(Moved_Map[1], "one");
+    ASSERT_EQ(MTL_Map.begin(), MTL_Map.end());
+    MTL_Map.reserve(100);
+    for (int i = 0; i < 1000; ++i) {
+        MTL_Map.Insert(i, std::to_string(i));
+    }
+    ASSERT_EQ(MTL_Map.size(), 1000);
+    ASSERT_EQ(MTL_Map[999], "999");
+    // the vector moves its sets when it grows
+    std::vector<mtl::sentinel_hash_set<uint64_t>> Sets;
+    Sets.push_back(std::move(MTL_Set));
+    for (uint64_t i = 1; i < 100; ++i) {
+        Sets.emplace_back();
+        Sets.back().Insert(i);
+    }
+    ASSERT_TRUE(Sets[0].Contains(3));
+    for (uint64_t i = 1; i < 100; ++i) {
+        ASSERT_EQ(Sets[i].size(), 1);
+        ASSERT_TRUE(Sets[i].Contains(i));
+    }
+    ASSERT_FALSE(MTL_Set.Contains(3));
+    ASSERT_TRUE(MTL_Set.Insert(3));
+    ASSERT_TRUE(MTL_Set.Contains(3));
+}
+
+// the number of live allocations of all the rebound CountingAllocators
+inline int64_t allocations = 0;
+
+template<typename T>
+struct CountingAllocator : std::allocator<T> {
+    template<typename X>
+    struct rebind {
+        using other = CountingAllocator<X>;
+    };
+
+    CountingAllocator() = default;
+
+    template<typename X>
+    CountingAllocator(const CountingAllocator<X>&) {}
+
+    T* allocate(size_t n) {
+        ++allocations;
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        --allocations;
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+template<typename Base>
+struct InlinePolicy : Base {
+    static constexpr size_t inline_capacity = 8;
+};
+
+struct FourPolicy : mtl::hash_policy {
+    static constexpr size_t inline_capacity = 4;
+};
+
+TYPED_TEST(FunctionalPolicyTest, InlineCapacityTest) {
+    using Map = mtl::hash_map<std::string, int, CountingAllocator<std::pair<std::string, int>>, std::hash<std::string>,
+            InlinePolicy<TypeParam>>;
+    allocations = 0;
+    {
+        Map MTL_Map;
+        for (int i = 0; i < 8; ++i) {
+            MTL_Map.Insert(std::to_string(i), i);
+        }
+        ASSERT_EQ(allocations, 0);
+        for (int i = 0; i < 1000; ++i) {
+            MTL_Map.Insert(std::to_string(i), i);
+        }
+        ASSERT_GT(allocations, 0);
+        for (int i = 0; i < 1000; ++i) {
+            ASSERT_EQ(MTL_Map[std::to_string(i)], i);
+        }
+        for (int i = 5; i < 1000; ++i) {
+            MTL_Map.Delete(std::to_string(i));
+        }
+        // the few remaining elements move back into the object
+        MTL_Map.shrink_to_fit();
+        ASSERT_EQ(allocations, 0);
+        ASSERT_EQ(MTL_Map.size(), 5);
+        for (int i = 0; i < 10; ++i) {
+            ASSERT_EQ(MTL_Map.Contains(std::to_string(i)), i < 5);
+        }
+    }
+    ASSERT_EQ(allocations, 0);
+}
+
+TEST(FunctionalHashMapTest, InlineCapacityTest) {
+    mtl::hash_set<int, std::allocator<int>, std::hash<int>, InlinePolicy<mtl::hash_policy>> MTL_Set;
+    MTL_Set.Insert(1);
+    ASSERT_TRUE(MTL_Set.Contains(1));
+    // a map of a few elements is filled, read and destroyed without a single allocation
+    allocations = 0;
+    for (int i = 0; i < 1000; ++i) {
+        mtl::hash_map<int, int, CountingAllocator<std::pair<int, int>>, std::hash<int>, InlinePolicy<mtl::hash_policy>>
+                Tiny_Map;
+        for (int j = 0; j < 6; ++j) {
+            Tiny_Map.Insert(i + j, j);
+        }
+        ASSERT_EQ(Tiny_Map[i + 3], 3);
+        ASSERT_EQ(allocations, 0);
+    }
+    // a table narrower than a group embeds just inline_capacity slots and fills all of them
+    {
+        mtl::hash_set<int, CountingAllocator<int>, std::hash<int>, FourPolicy> Four_Set;
+        for (int i = 0; i < 4; ++i) {
+            Four_Set.Insert(i * 1000);
+        }
+        ASSERT_EQ(Four_Set.capacity(), 4);
+        ASSERT_EQ(allocations, 0);
+        Four_Set.Delete(2000);
+        Four_Set.Insert(5000);
+        ASSERT_FALSE(Four_Set.Contains(2000));
+        ASSERT_TRUE(Four_Set.Contains(5000));
+        ASSERT_EQ(allocations, 0);
+        Four_Set.Insert(6000);
+        ASSERT_GT(allocations, 0);
+        for (int i: {0, 1000, 3000, 5000, 6000}) {
+            ASSERT_TRUE(Four_Set.Contains(i));
+        }
+    }
+    ASSERT_EQ(allocations, 0);
+}
+
+TEST(FunctionalHashMapTest, DefaultHashTest) {
+    mtl::hash<std::string> hash;
+    std::string text = "the quick brown fox jumps over the lazy dog, then the lazy dog jumps over the quick fox";
+    ASSERT_EQ(hash(text), hash(std::string_view(text)));
+    ASSERT_EQ(hash("hello"), hash(std::string("hello")));
+    // every length takes its own path through the short and the long input cases
+    std::unordered_set<size_t> prefixes;
+    for (size_t length = 0; length <= text.size(); ++length) {
+        prefixes.insert(hash(text.substr(0, length)));
+    }
+    ASSERT_EQ(prefixes.size(), text.size() + 1);
+    // strided ids are spread over the low bits
+    std::unordered_set<size_t> low_bits;
+    for (uint64_t i = 0; i < 4096; ++i) {
+        low_bits.insert(mtl::hash<uint64_t>()(i << 20u) & 4095);
+    }
+    ASSERT_GT(low_bits.size(), 2400);
+    mtl::hash<std::pair<int, int>> pair_hash;
+    ASSERT_NE(pair_hash(std::make_pair(1, 2)), pair_hash(std::make_pair(2, 1)));
+
+    mtl::hash_map<std::pair<int, int>, int> MTL_Map;
+    for (int i = 0; i < 1e4; ++i) {
+        MTL_Map.Insert({i, -i}, i);
+    }
+    ASSERT_EQ(MTL_Map[std::make_pair(42, -42)], 42);
+    ASSERT_FALSE(MTL_Map.Contains(std::make_pair(42, 42)));
+    mtl::hash_set<std::string> MTL_Set;
+    MTL_Set.Insert("hello");
+    ASSERT_FALSE(MTL_Set.Contains(std::string_view(text).substr(0, 0)));
+    ASSERT_TRUE(MTL_Set.Contains(std::string_view("hello world").substr(0, 5)));
+}
+
+TEST(FunctionalHashMapTest, SeededHashTest) {
+    ASSERT_NE(mtl::seeded_hash<std::string>()("key"), mtl::seeded_hash<std::string>()("key"));
+    ASSERT_EQ(mtl::seeded_hash<std::string>(7)("key"), mtl::seeded_hash<std::string>(7)("key"));
+
+    using Map = mtl::hash_map<uint64_t, std::array<int, 3>, std::allocator<std::pair<uint64_t, std::array<int, 3>>>,
+            mtl::seeded_hash<uint64_t>>;
+    auto path = testing::TempDir() + "mtl_seeded_snapshot";
+    {
+        Map MTL_Map;
+        for (uint64_t i = 0; i < 1e5; ++i) {
+            MTL_Map.Insert(i << 16u, {int(i), 0, 0});
+        }
+        for (uint64_t i = 0; i < 1e5; ++i) {
+            ASSERT_EQ(MTL_Map[i << 16u][0], int(i));
+        }
+        ASSERT_TRUE(MTL_Map.Save(path.c_str()));
+    }
+    // the mapping table takes the seed of the saved one
+    Map MTL_Map(1, {}, mtl::seeded_hash<uint64_t>(1));
+    ASSERT_TRUE(MTL_Map.MapFromFile(path.c_str()));
+    for (uint64_t i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(MTL_Map[i << 16u][0], int(i));
+    }
+    MTL_Map.Insert(1, {1, 1, 1});
+    ASSERT_TRUE(MTL_Map.Contains(1));
+    std::remove(path.c_str());
+
+    mtl::concurrent_hash_map<int, int, std::allocator<std::pair<int, int>>, mtl::seeded_hash<int>> Concurrent_Map;
+    for (int i = 0; i < 1e5; ++i) {
+        Concurrent_Map.Insert(i, -i);
+    }
+    for (int i = 0; i < 1e5; ++i) {
+        ASSERT_EQ(Concurrent_Map.Get(i), -i);
+    }
+}
+
+TYPED_TEST(FunctionalPolicyTest, SetAlgebraTest) {
+    for (size_t threads: {0, 1, 4}) {
+        using Set = mtl::hash_set<int, std::allocator<int>, mtl::hash<int>, TypeParam>;
+        Set evens, triples;
+        std::unordered_set<int> std_evens, std_triples;
+        for (int i = 0; i < 3e4; i += 2) {
+            evens.Insert(i);
+            std_evens.insert(i);
+        }
+        for (int i = 0; i < 6e4; i += 3) {
+            triples.Insert(i);
+            std_triples.insert(i);
+        }
+        Set united, common, difference;
+        evens.Union(triples, united, threads);
+        evens.Intersect(triples, common, threads);
+        evens.Difference(triples, difference, threads);
+        ASSERT_EQ(united.size(), std_evens.size() + std_triples.size() - common.size());
+        for (auto value: std_evens) {
+            ASSERT_TRUE(united.Contains(value));
+            ASSERT_EQ(common.Contains(value), std_triples.contains(value));
+            ASSERT_EQ(difference.Contains(value), !std_triples.contains(value));
+        }
+        for (auto value: std_triples) {
+            ASSERT_TRUE(united.Contains(value));
+            ASSERT_EQ(common.Contains(value), std_evens.contains(value));
+        }
+        ASSERT_EQ(difference.size(), std_evens.size() - common.size());
+        ASSERT_TRUE(common.IsSubset(evens, threads));
+        ASSERT_TRUE(common.IsSubset(triples, threads));
+        ASSERT_FALSE(evens.IsSubset(triples, threads));
+        ASSERT_TRUE(evens.IsSubset(united, threads));
+
+        // the outcome goes into a set that had deletes, the elements already there are not added twice
+        Set reused(1e5);
+        for (int i = 0; i < 1e4; ++i) {
+            reused.Insert(i);
+        }
+        for (int i = 1; i < 1e4; i += 2) {
+            reused.Delete(i);
+        }
+        evens.Union(triples, reused, threads);
+        ASSERT_EQ(reused.size(), united.size());
+        ASSERT_TRUE(reused.IsSubset(united, threads));
+        ASSERT_TRUE(united.IsSubset(reused, threads));
+        size_t count = 0;
+        for ([[maybe_unused]] auto value: reused) {
+            ++count;
+        }
+        ASSERT_EQ(count, united.size());
+    }
+}
+
+TYPED_TEST(FunctionalPolicyTest, CountParallelTest) {
+    for (size_t threads: {0, 1, 3}) {
+        using MultiSet = mtl::hash_multiset<std::string, std::allocator<std::pair<std::string, int32_t>>,
+                mtl::hash<std::string>, TypeParam>;
+        // value v occurs v % 97 + 1 times, in a shuffled order
+        std::vector<std::string> values;
+        for (int v = 0; v < 3000; ++v) {
+            for (int i = 0; i <= v % 97; ++i) {
+                values.push_back(std::to_string(v));
+            }
+        }
+        std::shuffle(values.begin(), values.end(), std::mt19937(42));
+        MultiSet Parallel_MultiSet, Serial_MultiSet;
+        Parallel_MultiSet.Insert("0");
+        Parallel_MultiSet.Insert("-1");
+        Parallel_MultiSet.CountParallel(values, threads);
+        for (auto& value: values) {
+            Serial_MultiSet.Insert(value);
+        }
+        ASSERT_EQ(Parallel_MultiSet.size(), Serial_MultiSet.size() + 1);
+        for (int v = 0; v < 3000; ++v) {
+            ASSERT_EQ(Parallel_MultiSet.Count(std::to_string(v)), v % 97 + 1 + (v == 0));
+        }
+        ASSERT_EQ(Parallel_MultiSet.Count("-1"), 1);
+
+        auto top = Parallel_MultiSet.TopK(5, threads);
+        ASSERT_EQ(top.size(), 5);
+        for (auto& [value, count]: top) {
+            ASSERT_EQ(count, 97);
+            ASSERT_EQ(std::stoi(value) % 97, 96);
+        }
+        ASSERT_EQ(Parallel_MultiSet.TopK(5000).size(), 3001);
+        ASSERT_TRUE(Parallel_MultiSet.TopK(0).empty());
+
+        // counting into a multiset that had deletes adds to the present counts, even for the values that share
+        // their home slots with the deleted ones
+        MultiSet Reused_MultiSet(6000);
+        for (int v = 0; v < 3000; ++v) {
+            Reused_MultiSet.Insert(std::to_string(v));
+        }
+        for (int v = 1; v < 3000; v += 2) {
+            Reused_MultiSet.Delete(std::to_string(v));
+        }
+        Reused_MultiSet.CountParallel(values, threads);
+        ASSERT_EQ(Reused_MultiSet.size(), 3000);
+        for (int v = 0; v < 3000; ++v) {
+            ASSERT_EQ(Reused_MultiSet.Count(std::to_string(v)), v % 97 + 1 + (v % 2 == 0));
+        }
+        ASSERT_EQ(Reused_MultiSet.TopK(5000, threads).size(), 3000);
+    }
+}
+
+TYPED_TEST(FunctionalPolicyTest, CacheTest) {
+    mtl::hash_cache<int, std::string, mtl::hash<int>, TypeParam> Cache(1000);
+    for (int i = 0; i < 1100; ++i) {
+        Cache.Insert(i, std::to_string(i));
+    }
+    ASSERT_EQ(Cache.size(), 1000);
+    ASSERT_EQ(Cache.stats().evictions, 100);
+    std::vector<int> hot;
+    for (int i = 0; i < 1100; i += 2) {
+        if (Cache.Contains(i)) {
+            ASSERT_EQ(*Cache.Find(i), std::to_string(i));
+            hot.push_back(i);
+        }
+    }
+    // the new keys push out the others, the keys hit since the hand last passed them stay
+    for (int i = 2000; i < 2250; ++i) {
+        Cache.Insert(i, std::to_string(i));
+    }
+    ASSERT_EQ(Cache.size(), 1000);
+    ASSERT_EQ(Cache.stats().evictions, 350);
+    for (auto i: hot) {
+        ASSERT_TRUE(Cache.Contains(i));
+    }
+    ASSERT_EQ(Cache.stats().hits, hot.size());
+    ASSERT_EQ(Cache.Find(-1), nullptr);
+    ASSERT_EQ(Cache.stats().misses, 1);
+    Cache.Insert(0, "zero");
+    ASSERT_EQ(*Cache.Find(0), "zero");
+    ASSERT_TRUE(Cache.Delete(0));
+    ASSERT_FALSE(Cache.Delete(0));
+    ASSERT_EQ(Cache.size(), 999);
+    // churn never grows the table
+    auto memory = Cache.memory_usage();
+    auto evictions = Cache.stats().evictions;
+    size_t loads = 0;
+    for (int i = 0; i < 100000; ++i) {
+        auto key = i % 3 == 0 ? i / 3 % 50 : 3000 + i;
+        ASSERT_EQ(Cache.FindOrLoad(key, [&loads](int key) {
+            ++loads;
+            return std::to_string(key);
+        }), std::to_string(key));
+        ASSERT_LE(Cache.size(), 1000);
+    }
+    ASSERT_EQ(Cache.memory_usage(), memory);
+    ASSERT_EQ(Cache.stats().evictions, evictions + loads - 1);
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_TRUE(Cache.Contains(i));
+    }
+}
+
+TEST(FunctionalHashCacheTest, ZipfTest) {
+    // skewed keys, a few frequent ones and a long tail
+    std::vector<uint64_t> keys(2e5);
+    std::mt19937_64 random(11);
+    for (auto& key: keys) {
+        key = random() % (1u << (random() % 16 + 1));
+    }
+    const size_t size = 4096;
+    mtl::hash_cache<uint64_t, uint64_t> MTL_Cache(size);
+    size_t mtl_hits = 0;
+    for (auto key: keys) {
+        if (auto value = MTL_Cache.Find(key)) {
+            ASSERT_EQ(*value, key);
+            ++mtl_hits;
+        } else {
+            MTL_Cache.Insert(key, key);
+        }
+        ASSERT_LE(MTL_Cache.size(), size);
+    }
+    ASSERT_EQ(MTL_Cache.stats().hits, mtl_hits);
+    // the usual LRU: a list in use order and a map of iterators into it
+    std::list<uint64_t> order;
+    std::unordered_map<uint64_t, decltype(order)::iterator> STD_Cache(size);
+    size_t std_hits = 0;
+    for (auto key: keys) {
+        if (auto it = STD_Cache.find(key); it != STD_Cache.end()) {
+            order.splice(order.begin(), order, it->second);
+            ++std_hits;
+        } else {
+            if (order.size() == size) {
+                STD_Cache.erase(order.back());
+                order.pop_back();
+            }
+            order.push_front(key);
+            STD_Cache[key] = order.begin();
+        }
+    }
+    // CLOCK approximates LRU, the hit ratios stay close and the hottest keys are never evicted
+    ASSERT_GT(mtl_hits * 100, std_hits * 95);
+    for (uint64_t key = 0; key < 16; ++key) {
+        ASSERT_TRUE(MTL_Cache.Contains(key));
     }
-    end = std::chrono::steady_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << '\n';
 }
 